@@ -13,6 +13,7 @@
 #include "action_led.h"
 #include "avr_util.h"
 #include "custom_defs.h"
+#include "diag_transport.h"
 #include "hardware_clock.h"
 #include "io_pins.h"
 #include "lin_processor.h"
@@ -20,10 +21,18 @@
 #include "system_clock.h"
 
 // FRAMES LED - blinks when detecting valid frames.
-static ActionLed frames_activity_led(PORTB, 0);
+static ActionLed<io_pins::Pin<io_pins::PortB, 0> > frames_activity_led;
 
 // ERRORS LED - blinks when detecting errors.
-static ActionLed errors_activity_led(PORTB, 1);
+static ActionLed<io_pins::Pin<io_pins::PortB, 1> > errors_activity_led;
+
+// Called once during initialization when custom_defs::kUseMasterSchedule is true.
+// The example schedule polls the buttons of the 981/Cayman console module.
+static void setupMasterSchedule() {
+  lin_processor::setScheduleEntry(0, 0x0e, 20, NULL, 0);
+  lin_processor::setScheduleEntry(1, 0x0d, 20, NULL, 0);
+  lin_processor::startSchedule(2);
+}
 
 // Arduino setup function. Called once during initialization.
 void setup()
@@ -37,10 +46,16 @@ void setup()
 
   // Uses Timer2 with interrupts, and a few i/o pins. See source code for details.
   lin_processor::setup();
+
+  diag_transport::setup();
   
   // Enable global interrupts. We expect to have only timer1 interrupts by
   // the lin processor to reduce ISR jitter.
   sei(); 
+
+  if (custom_defs::kUseMasterSchedule) {
+    setupMasterSchedule();
+  }
   
   // Have an early 'waiting' led bling to indicate normal operation.
   frames_activity_led.action(); 
@@ -93,10 +108,22 @@ void loop()
         pending_lin_errors = 0;
       }
     }
+
+    // Handle diagnostic transport errors.
+    if (custom_defs::kUseDiagTransport) {
+      const uint8 diag_errors = diag_transport::getAndClearErrorFlags();
+      if (diag_errors) {
+        errors_activity_led.action();
+        sio::print(F("DIAG errors: "));
+        diag_transport::printErrorFlags(diag_errors);
+        sio::println();
+      }
+    }
     
     // Handle recieved LIN frames.
     LinFrame frame;
     if (lin_processor::readNextFrame(&frame)) {
+      checksum_models::learnFrame(frame);
       const boolean frameOk = frame.isValid();
       if (frameOk) {
         // Make the FRAMES led blinking.
@@ -107,17 +134,28 @@ void loop()
         errors_activity_led.action();
       }
       
-      // Print frame to serial port.
-      for (int i = 0; i < frame.num_bytes(); i++) {
-        if (i > 0) {
-          sio::printchar(' ');  
+      // Diagnostic frames are printed as complete messages.
+      const uint8 id = frame.num_bytes() ? (frame.get_byte(0) & 0x3f) : 0;
+      const boolean is_diag_frame = custom_defs::kUseDiagTransport && frameOk
+          && (id == diag_transport::kMasterRequestId || id == diag_transport::kSlaveResponseId);
+      if (is_diag_frame) {
+        const diag_transport::Message* const message = diag_transport::frameArrived(frame);
+        if (message) {
+          diag_transport::printMessage(*message);
         }
-        sio::printhex2(frame.get_byte(i));  
-      }
-      if (!frameOk) {
-        sio::print(F(" ERR"));
+      } else {
+        // Print frame to serial port.
+        for (int i = 0; i < frame.num_bytes(); i++) {
+          if (i > 0) {
+            sio::printchar(' ');  
+          }
+          sio::printhex2(frame.get_byte(i));  
+        }
+        if (!frameOk) {
+          sio::print(F(" ERR"));
+        }
+        sio::println();  
       }
-      sio::println();  
       // Supress the 'waiting' messages.
       idle_timer.restart(); 
     }
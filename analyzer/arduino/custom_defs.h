@@ -28,6 +28,14 @@ namespace custom_defs {
   // Supported baud range is 1000 to 20000. If out of range, using silently default
   // baud of 9600.
   const uint16 kLinSpeed = 19200;
+
+  // True to run the master schedule table in arduino.ino, e.g. to drive a
+  // disconnected slave on the bench. False to only listen to the bus.
+  const boolean kUseMasterSchedule = false;
+
+  // True to reassemble the diagnostic frames (0x3c, 0x3d) into transport layer
+  // messages. The messages are printed instead of the raw diagnostic frames.
+  const boolean kUseDiagTransport = false;
   
 }  // namepsace custom_defs
 
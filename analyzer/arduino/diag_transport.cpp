@@ -0,0 +1,238 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "diag_transport.h"
+
+#include "sio.h"
+#include "system_clock.h"
+
+namespace diag_transport {
+
+  // Private state. Do not use from other files.
+  namespace private_ {
+    Slot slots[kMaxSlots];
+
+    uint8 error_flags;
+
+    // Number of frame bytes of a diagnostic frame. Id, NAD, PCI, 6 data bytes
+    // and checksum.
+    static const uint8 kFrameBytes = 1 + 8 + 1;
+
+    // PCI types, in the high nibble of the PCI byte.
+    static const uint8 kPciSingleFrame = 0x00;
+    static const uint8 kPciFirstFrame = 0x10;
+    static const uint8 kPciConsecutiveFrame = 0x20;
+
+    // Return the slot of the message in progress of the given NAD and direction,
+    // or NULL.
+    static Slot* findSlot(uint8 nad, boolean is_response) {
+      for (uint8 i = 0; i < kMaxSlots; i++) {
+        Slot* const slot = &slots[i];
+        if (slot->in_use && slot->message.nad == nad
+            && slot->message.is_response == is_response) {
+          return slot;
+        }
+      }
+      return NULL;
+    }
+
+    // Return a slot for a new message of the given NAD and direction, aborting
+    // its message in progress, if any. Returns NULL if all the slots are in use.
+    static Slot* startSlot(uint8 nad, boolean is_response, uint16 length) {
+      Slot* slot = findSlot(nad, is_response);
+      if (slot) {
+        error_flags |= errors::ABORTED;
+      } else {
+        for (uint8 i = 0; i < kMaxSlots; i++) {
+          if (!slots[i].in_use) {
+            slot = &slots[i];
+            break;
+          }
+        }
+        if (!slot) {
+          error_flags |= errors::NO_SLOT;
+          return NULL;
+        }
+      }
+      slot->in_use = true;
+      slot->next_sequence = 1;
+      slot->message.nad = nad;
+      slot->message.is_response = is_response;
+      slot->message.length = length;
+      slot->message.bytes_recieved = 0;
+      return slot;
+    }
+
+    // Append n bytes of the frame, starting at byte index, up to the message
+    // length. Returns true if the message is complete.
+    static boolean appendBytes(Slot* slot, const LinFrame& frame, uint8 index, uint8 n) {
+      Message& message = slot->message;
+      for (uint8 i = 0; i < n && message.bytes_recieved < message.length; i++) {
+        if (message.bytes_recieved < kMaxMessageBytes) {
+          message.bytes[message.bytes_recieved] = frame.get_byte(index + i);
+        }
+        message.bytes_recieved++;
+      }
+      slot->last_frame_millis = system_clock::timeMillis();
+      return message.bytes_recieved >= message.length;
+    }
+
+    // Free the slots whose messages timed out.
+    static void expireSlots() {
+      const uint32 now = system_clock::timeMillis();
+      for (uint8 i = 0; i < kMaxSlots; i++) {
+        Slot* const slot = &slots[i];
+        if (slot->in_use && (now - slot->last_frame_millis) > kTimeoutMillis) {
+          slot->in_use = false;
+          error_flags |= errors::TIMEOUT;
+        }
+      }
+    }
+  }
+
+  void setup() {
+    for (uint8 i = 0; i < private_::kMaxSlots; i++) {
+      private_::slots[i].in_use = false;
+    }
+    private_::error_flags = 0;
+  }
+
+  const Message* frameArrived(const LinFrame& frame) {
+    using namespace private_;
+
+    expireSlots();
+
+    // Diagnostic frames always have 8 data bytes.
+    const uint8 id = frame.get_byte(0) & 0x3f;
+    if ((id != kMasterRequestId && id != kSlaveResponseId) || frame.num_bytes() != kFrameBytes) {
+      return NULL;
+    }
+    const boolean is_response = (id == kSlaveResponseId);
+    const uint8 nad = frame.get_byte(1);
+    const uint8 pci = frame.get_byte(2);
+
+    // A master request with NAD 0 is a go to sleep command, not a PDU.
+    if (!is_response && !nad) {
+      return NULL;
+    }
+
+    Slot* slot;
+    switch (pci & 0xf0) {
+      case kPciSingleFrame: {
+        const uint8 length = pci & 0x0f;
+        if (length < 1 || length > 6) {
+          error_flags |= errors::BAD_PCI;
+          return NULL;
+        }
+        slot = startSlot(nad, is_response, length);
+        if (!slot) {
+          return NULL;
+        }
+        appendBytes(slot, frame, 3, length);
+        break;
+      }
+
+      case kPciFirstFrame: {
+        const uint16 length = ((uint16)(pci & 0x0f) << 8) | frame.get_byte(3);
+        if (length < 7) {
+          error_flags |= errors::BAD_PCI;
+          return NULL;
+        }
+        slot = startSlot(nad, is_response, length);
+        if (!slot) {
+          return NULL;
+        }
+        // Never completes the message.
+        appendBytes(slot, frame, 4, 5);
+        return NULL;
+      }
+
+      case kPciConsecutiveFrame: {
+        slot = findSlot(nad, is_response);
+        if (!slot) {
+          error_flags |= errors::UNEXPECTED_CF;
+          return NULL;
+        }
+        if ((pci & 0x0f) != slot->next_sequence) {
+          error_flags |= errors::SEQUENCE;
+          slot->in_use = false;
+          return NULL;
+        }
+        slot->next_sequence = (slot->next_sequence + 1) & 0x0f;
+        if (!appendBytes(slot, frame, 3, 6)) {
+          return NULL;
+        }
+        break;
+      }
+
+      default:
+        error_flags |= errors::BAD_PCI;
+        return NULL;
+    }
+
+    // Here when the message is complete. The slot is free for the next call but
+    // its content is kept until then.
+    slot->in_use = false;
+    return &slot->message;
+  }
+
+  uint8 getAndClearErrorFlags() {
+    const uint8 result = private_::error_flags;
+    private_::error_flags = 0;
+    return result;
+  }
+
+  struct BitName {
+    const uint8 mask;
+    const char* const name;
+  };
+
+  static const BitName kErrorBitNames[] PROGMEM = {
+    { errors::SEQUENCE, "SEQ" },
+    { errors::UNEXPECTED_CF, "CF" },
+    { errors::ABORTED, "ABRT" },
+    { errors::TIMEOUT, "TOUT" },
+    { errors::BAD_PCI, "PCI" },
+    { errors::NO_SLOT, "SLOT" },
+  };
+
+  void printErrorFlags(uint8 diag_errors) {
+    const uint8 n = ARRAY_SIZE(kErrorBitNames);
+    boolean any_printed = false;
+    for (uint8 i = 0; i < n; i++) {
+      const uint8 mask = pgm_read_byte(&kErrorBitNames[i].mask);
+      if (diag_errors & mask) {
+        if (any_printed) {
+          sio::printchar(' ');
+        }
+        const char* const name = (const char*)pgm_read_word(&kErrorBitNames[i].name);
+        sio::print(name);
+        any_printed = true;
+      }
+    }
+  }
+
+  void printMessage(const Message& message) {
+    sio::print(message.is_response ? F("DIAG RSP ") : F("DIAG REQ "));
+    sio::printhex2(message.nad);
+    sio::printf(F(" %u:"), message.length);
+    const uint8 n = (message.length < kMaxMessageBytes) ? message.length : kMaxMessageBytes;
+    for (uint8 i = 0; i < n; i++) {
+      sio::printchar(' ');
+      sio::printhex2(message.bytes[i]);
+    }
+    if (n < message.length) {
+      sio::print(F(" ..."));
+    }
+    sio::println();
+  }
+}  // namespace diag_transport
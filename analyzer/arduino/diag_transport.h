@@ -0,0 +1,104 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DIAG_TRANSPORT_H
+#define DIAG_TRANSPORT_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+
+// Reassembly of the LIN diagnostic transport layer. Master request (0x3c) and
+// slave response (0x3d) frames carry PDUs of a NAD (node address), a PCI byte
+// and up to 6 data bytes. A message is sent either as a single frame (SF) or as
+// a first frame (FF) followed by consecutive frames (CF) with a 4 bit sequence
+// number, possibly interleaved with other frames of the schedule.
+//
+// Messages in progress are tracked by NAD and direction in a small fixed set of
+// slots. Message bytes beyond kMaxMessageBytes are counted but not stored, so the
+// memory use is bounded regardless of the message length (up to 4095 bytes).
+//
+// Main thread only.
+namespace diag_transport {
+  // Frame ids of the diagnostic frames.
+  static const uint8 kMasterRequestId = 0x3c;
+  static const uint8 kSlaveResponseId = 0x3d;
+
+  // Max number of stored bytes per message.
+  static const uint8 kMaxMessageBytes = 64;
+
+  // Error flags. Like enum but 8 bits only.
+  namespace errors {
+    // A CF with an unexpected sequence number. The message is dropped.
+    static const uint8 SEQUENCE = (1 << 0);
+    // A CF with no FF before it.
+    static const uint8 UNEXPECTED_CF = (1 << 1);
+    // A new SF or FF of a NAD and direction that has a message in progress.
+    static const uint8 ABORTED = (1 << 2);
+    // No CF within kTimeoutMillis. The message is dropped.
+    static const uint8 TIMEOUT = (1 << 3);
+    // A PDU with a bad PCI or length.
+    static const uint8 BAD_PCI = (1 << 4);
+    // All the slots were in use by other messages.
+    static const uint8 NO_SLOT = (1 << 5);
+  }
+
+  // A reassembled message, or a message in progress.
+  struct Message {
+    uint8 nad;
+    // True for a slave response (0x3d), false for a master request (0x3c).
+    boolean is_response;
+    // The message length by the SF or FF.
+    uint16 length;
+    // Number of bytes recieved so far, including those not stored.
+    uint16 bytes_recieved;
+    // The first min(length, kMaxMessageBytes) bytes of the message. Starts with
+    // the service id.
+    uint8 bytes[kMaxMessageBytes];
+  };
+
+  // Private state. Do not use from other files.
+  namespace private_ {
+    // Max number of messages in progress at the same time.
+    static const uint8 kMaxSlots = 2;
+
+    // Max time between the frames of a message, the LIN N_Cr timeout.
+    static const uint16 kTimeoutMillis = 1000;
+
+    struct Slot {
+      boolean in_use;
+      // The sequence number of the next CF, 4 bits.
+      uint8 next_sequence;
+      uint32 last_frame_millis;
+      Message message;
+    };
+  }
+
+  // Called once from setup().
+  extern void setup();
+
+  // Process a recieved frame that passed LinFrame::isValid(). Frames with other
+  // ids are ignored. If the frame completes a message, returns it. Otherwise
+  // returns NULL. The returned message is valid until the next call.
+  extern const Message* frameArrived(const LinFrame& frame);
+
+  // Get the error flags and clear them.
+  extern uint8 getAndClearErrorFlags();
+
+  // Print the names of the error flags in the given value.
+  extern void printErrorFlags(uint8 diag_errors);
+
+  // Print a message, e.g. "DIAG REQ 0a 3: 22 f1 90", on one line. Truncated
+  // messages end with " ...".
+  extern void printMessage(const Message& message);
+}
+
+#endif
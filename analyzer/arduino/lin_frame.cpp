@@ -13,11 +13,77 @@
 #include "lin_frame.h"
 
 #include "custom_defs.h"
+#include "sio.h"
+
+namespace checksum_models {
+  namespace private_ {
+    // The diagnostic ids 0x3c and 0x3d are known as classic.
+    uint8 known_ids[8] = { 0, 0, 0, 0, 0, 0, 0, H(0x3c & 0x07) | H(0x3d & 0x07) };
+    uint8 enhanced_ids[8];
+
+    // A model is learned after this many consecutive frames of the id agree on
+    // it. Until then isValid() accepts both models.
+    static const uint8 kRequiredModelReports = 3;
+
+    // The pending reports of the ids whose model is not known yet, a nibble per
+    // 6 bit id. The low bits count the consecutive frames that matched the same
+    // model and kPendingEnhancedBit is set if that model is enhanced. Main only.
+    static const uint8 kPendingCountMask = 0x03;
+    static const uint8 kPendingEnhancedBit = 0x04;
+    static uint8 pending_reports[32];
+  }
+
+  void learnFrame(const LinFrame& frame) {
+    // Learn only from frames with a response and a valid id.
+    const uint8 n = frame.num_bytes();
+    if (n < 3 || n > LinFrame::kMaxBytes) {
+      return;
+    }
+    const uint8 id_byte = frame.get_byte(0);
+    if (id_byte != LinFrame::setLinIdChecksumBits(id_byte) || modelOf(id_byte) != UNKNOWN) {
+      return;
+    }
+
+    // A bad frame matches a model only by chance. If both match, the id byte
+    // does not change the sum and the frame tells nothing.
+    const uint8 checksum = frame.get_byte(n - 1);
+    const boolean is_enhanced = (checksum == frame.computeChecksum(true));
+    const boolean is_classic = (checksum == frame.computeChecksum(false));
+    if (is_enhanced == is_classic) {
+      return;
+    }
+
+    // A frame of the other model starts a new count.
+    const uint8 id6 = id_byte & 0x3f;
+    const uint8 shift = (id6 & 0x01) ? 4 : 0;
+    uint8* const pending_byte = &private_::pending_reports[id6 >> 1];
+    const uint8 pending = (*pending_byte >> shift) & 0x0f;
+    const uint8 model_bit = is_enhanced ? private_::kPendingEnhancedBit : 0;
+    uint8 count = pending & private_::kPendingCountMask;
+    count = (count && (pending & private_::kPendingEnhancedBit) == model_bit) ? count + 1 : 1;
+    if (count < private_::kRequiredModelReports) {
+      *pending_byte = (*pending_byte & ~(0x0f << shift)) | ((model_bit | count) << shift);
+      return;
+    }
+
+    const uint8 mask = bitMask(id6 & 0x07);
+    if (is_enhanced) {
+      private_::enhanced_ids[id6 >> 3] |= mask;
+    }
+    private_::known_ids[id6 >> 3] |= mask;
+    sio::printf(F("Checksum of %02x: "), id6);
+    sio::println(is_enhanced ? F("enhanced") : F("classic"));
+  }
+}
 
-// Compute the checksum of the frame. For now using LIN checksum V2 only.
 uint8 LinFrame::computeChecksum() const {
+  return computeChecksum(checksum_models::isEnhanced(bytes_[0]));
+}
+
+// Compute the checksum of the frame with the given model.
+uint8 LinFrame::computeChecksum(boolean enhanced) const {
   // LIN V2 checksum includes the ID byte, V1 does not.
-  const uint8 startByteIndex = custom_defs::kUseLinChecksumVersion2 ? 0 : 1;
+  const uint8 startByteIndex = enhanced ? 0 : 1;
   const uint8* p = &bytes_[startByteIndex];
   
   // Exclude the checksum byte at the end of the frame.
@@ -95,9 +161,15 @@ boolean LinFrame::isValid() const {
     return false;
   }
 
-  // If not an ID only frame, check also the overall checksum.
+  // If not an ID only frame, check also the overall checksum. Frames of ids whose
+  // checksum model is not known yet may use either model.
   if (n > 1) {
-    if (bytes_[n - 1] != computeChecksum()) {
+    const uint8 checksum = bytes_[n - 1];
+    if (checksum_models::modelOf(id_byte) == checksum_models::UNKNOWN) {
+      if (checksum != computeChecksum(true) && checksum != computeChecksum(false)) {
+        return false;
+      }
+    } else if (checksum != computeChecksum()) {
       return false;
     }  
   }
@@ -17,6 +17,7 @@
 #include "avr_util.h"
 #include "custom_defs.h"
 #include "hardware_clock.h"
+#include "io_pins.h"
 
 // TODO: for debugging. Remove.
 #include "sio.h"
@@ -34,39 +35,6 @@ static const uint16 kDefaultBaud = 9600;
 //
 static const uint8 kMaxSpaceBits = 6;
 
-// Define an input pin with fast access. Using the macro does
-// not increase the pin access time compared to direct bit manipulation.
-// Pin is setup with active pullup.
-#define DEFINE_INPUT_PIN(name, port_letter, bit_index) \
-  namespace name { \
-    static const uint8 kPinMask  = H(bit_index); \
-    static inline void setup() { \
-      DDR ## port_letter &= ~kPinMask;  \
-      PORT ## port_letter |= kPinMask;  \
-    } \
-    static inline uint8 isHigh() { \
-      return  PIN##port_letter & kPinMask; \
-    } \
-  } 
- 
-// Define an output pin with fast access. Using the macro does
-// not increase the pin access time compared to direct bit manipulation.
-#define DEFINE_OUTPUT_PIN(name, port_letter, bit_index, initial_value) \
-  namespace name { \
-    static const uint8 kPinMask  = H(bit_index); \
-    static inline void setHigh() { \
-      PORT ## port_letter |= kPinMask; \
-    } \
-    static inline void setLow() { \
-      PORT ## port_letter &= ~kPinMask; \
-    } \
-    static inline void setup() { \
-      DDR ## port_letter |= kPinMask;  \
-      (initial_value) ? setHigh() : setLow(); \
-    } \
-  }  
-  
-
 namespace lin_processor {
 
   class Config {
@@ -134,29 +102,30 @@ namespace lin_processor {
 
   // ----- Digital I/O pins
   //
-  // NOTE: we use direct register access instead the abstractions in io_pins.h. 
-  // This way we shave a few cycles from the ISR.
+  // NOTE: the io_pins::Pin accesses compile to single bit instructions so they
+  // add no cycles to the ISR compared to direct register access.
     
   // LIN interface.
-  DEFINE_INPUT_PIN(rx_pin, D, 2);
-  // TODO: Not use, as of Apr 2014.
-  DEFINE_OUTPUT_PIN(tx1_pin, C, 2, 1);
+  typedef io_pins::Pin<io_pins::PortD, 2> rx_pin;
+  // Used to send emulated slave responses. High is the passive state.
+  typedef io_pins::Pin<io_pins::PortC, 2> tx1_pin;
   
   // Debugging signals.
-  DEFINE_OUTPUT_PIN(break_pin, C, 0, 0);
-  DEFINE_OUTPUT_PIN(sample_pin, B, 4, 0);
-  DEFINE_OUTPUT_PIN(error_pin, B, 3, 0);
-  DEFINE_OUTPUT_PIN(isr_pin, C, 3, 0);
-  DEFINE_OUTPUT_PIN(gp_pin, D, 6, 0);
+  typedef io_pins::Pin<io_pins::PortC, 0> break_pin;
+  typedef io_pins::Pin<io_pins::PortB, 4> sample_pin;
+  typedef io_pins::Pin<io_pins::PortB, 3> error_pin;
+  typedef io_pins::Pin<io_pins::PortC, 3> isr_pin;
+  typedef io_pins::Pin<io_pins::PortD, 6> gp_pin;
 
   // Called one during initialization.
   static inline void setupPins() {
-    rx_pin::setup();
-    break_pin::setup();
-    sample_pin::setup();
-    error_pin::setup();
-    isr_pin::setup();
-    gp_pin::setup();
+    rx_pin::setupInput();
+    tx1_pin::setupOutput(true);
+    break_pin::setupOutput(false);
+    sample_pin::setupOutput(false);
+    error_pin::setupOutput(false);
+    isr_pin::setupOutput(false);
+    gp_pin::setupOutput(false);
   }
 
   // ----- ISR RX Ring Buffers -----
@@ -235,6 +204,7 @@ namespace lin_processor {
   namespace states {
     static const uint8 DETECT_BREAK = 1;
     static const uint8 READ_DATA = 2;
+    static const uint8 SEND_BYTES = 3;
   }
   static uint8 state;
 
@@ -251,9 +221,14 @@ namespace lin_processor {
    public:
     // Should be called after the break stop bit was detected.
     static inline void enter();
+    // Should be called at the end of the stop bit of an id byte we sent, to read
+    // the slave response.
+    static inline void enterAfterId();
     static inline void handleIsr();
     
    private:
+    static inline void waitForNextByte();
+
     // Number of complete bytes read so far. Includes all bytes, even
     // sync, id and checksum.
     static uint8 bytes_read_;
@@ -271,6 +246,82 @@ namespace lin_processor {
     static uint8 byte_buffer_bit_mask_;
   };
 
+  // An emulated slave response. See setSlaveResponse().
+  struct SlaveResponse {
+    // The id byte, including the two parity bits, as it appears on the wire.
+    uint8 protected_id;
+    // Number of data and checksum bytes. Zero if this entry is not in use.
+    uint8 num_bytes;
+    // The data bytes followed by the checksum byte.
+    uint8 bytes[LinFrame::kMaxBytes - 1];
+  };
+
+  // A master schedule table entry. See setScheduleEntry().
+  struct ScheduleEntry {
+    // The id byte, including the two parity bits, as it appears on the wire.
+    uint8 protected_id;
+    // Slot length in hardware clock ticks.
+    uint16 slot_clock_ticks;
+    // Number of master published data and checksum bytes. Zero if the response
+    // is sent by a slave.
+    uint8 num_bytes;
+    // The data bytes followed by the checksum byte.
+    uint8 bytes[LinFrame::kMaxBytes - 1];
+  };
+
+  // Sends bytes on the bit ticks, reading back each bit. Used for emulated slave
+  // responses and for master headers, with or without master published data.
+  class StateSendBytes {
+   public:
+    // Start a slave response. Should be called in the middle of the stop bit of
+    // the id byte, or at its end if we sent it (adding half a bit of response
+    // space).
+    static inline void enterResponse(const SlaveResponse& response);
+    // Start a header. Should be called on a tick when the bus is idle.
+    static inline void enterHeader(const ScheduleEntry& entry);
+    static inline void handleIsr();
+
+   private:
+    // Bit slots of a byte. A tick starts a new slot.
+    static const uint8 kStartSlot = 0;
+    static const uint8 kStopSlot = 9;
+    // A recessive slot that is not part of a byte, e.g. the response space or the
+    // break delimiter.
+    static const uint8 kSpaceSlot = 10;
+    // A dominant slot of the break.
+    static const uint8 kBreakSlot = 11;
+
+    // Number of dominant bits in a break we send.
+    static const uint8 kBreakBits = 13;
+
+    // A copy of the bytes to send, taken when sending starts, so the main can
+    // update the tables at any time. A header includes also the sync byte.
+    static uint8 tx_buffer_[LinFrame::kMaxBytes + 1];
+    static uint8 tx_bytes_;
+
+    // Index of the first byte of tx_buffer_ that is appended to the frame buffer.
+    // Used to skip the sync byte.
+    static uint8 first_appended_byte_;
+
+    // True if after the last byte the response is expected from a slave.
+    static boolean receive_response_;
+
+    // Number of bytes sent and verified so far.
+    static uint8 bytes_sent_;
+
+    // Number of break slots left, including the one in progress.
+    static uint8 break_slots_left_;
+
+    // The slot in progress and the level we drive in it.
+    static uint8 slot_;
+    static boolean is_tx_high_;
+
+    // The slot that starts at the next tick and the level to drive in it. Computed
+    // in advance so the output changes at a fixed short delay from the tick.
+    static uint8 next_slot_;
+    static boolean next_tx_high_;
+  };
+
   // ----- Error Flag. -----
 
   // Written from ISR. Read/Write from main. Bit mask of pending errors.
@@ -309,6 +360,7 @@ namespace lin_processor {
     { errors::SYNC_BYTE, "SYNC" },
     { errors::BUFFER_OVERRUN, "OVRN" },
     { errors::OTHER, "OTHR" },
+    { errors::TX_COLLISION, "COLL" },
   };
 
   // Given a byte with lin processor error bitset, print the list
@@ -329,6 +381,177 @@ namespace lin_processor {
     }
   }
 
+  // ----- Slave Responses Table -----
+
+  // Written by main with interrupts disabled. Read by ISR.
+  static SlaveResponse slave_responses[kMaxSlaveResponses];
+
+  // Return the response of the given id byte or NULL if none. Called from ISR.
+  static inline const SlaveResponse* findSlaveResponse(uint8 protected_id) {
+    for (uint8 i = 0; i < kMaxSlaveResponses; i++) {
+      const SlaveResponse& response = slave_responses[i];
+      if (response.num_bytes && response.protected_id == protected_id) {
+        return &response;
+      }
+    }
+    return NULL;
+  }
+
+  // Return the entry with the given id byte, or NULL if none. Called from main.
+  static SlaveResponse* findSlaveResponseEntry(uint8 protected_id) {
+    for (uint8 i = 0; i < kMaxSlaveResponses; i++) {
+      SlaveResponse* const response = &slave_responses[i];
+      if (response->num_bytes && response->protected_id == protected_id) {
+        return response;
+      }
+    }
+    return NULL;
+  }
+
+  // Compute the checksum of a frame we send. Done once when a table entry is set,
+  // using the same code that verifies the recieved frames. Called from main.
+  static uint8 computeChecksum(uint8 protected_id, const uint8* data, uint8 num_data_bytes) {
+    LinFrame frame;
+    frame.append_byte(protected_id);
+    for (uint8 i = 0; i < num_data_bytes; i++) {
+      frame.append_byte(data[i]);
+    }
+    // A place holder for the checksum byte.
+    frame.append_byte(0);
+    return frame.computeChecksum();
+  }
+
+  // Public. Called from main. See .h for description.
+  boolean setSlaveResponse(uint8 id, const uint8* data, uint8 num_data_bytes) {
+    if (num_data_bytes < 1 || num_data_bytes > LinFrame::kMaxBytes - 2) {
+      return false;
+    }
+    const uint8 protected_id = LinFrame::setLinIdChecksumBits(id);
+    const uint8 checksum = computeChecksum(protected_id, data, num_data_bytes);
+
+    // Only main modifies the table so no need to disable interrupts for the lookup.
+    SlaveResponse* response = findSlaveResponseEntry(protected_id);
+    for (uint8 i = 0; !response && i < kMaxSlaveResponses; i++) {
+      if (!slave_responses[i].num_bytes) {
+        response = &slave_responses[i];
+      }
+    }
+    if (!response) {
+      return false;
+    }
+
+    // The ISR copies the entry at the id byte so it never sees a partial update.
+    waitForIsrEnd();
+    cli();
+    for (uint8 i = 0; i < num_data_bytes; i++) {
+      response->bytes[i] = data[i];
+    }
+    response->bytes[num_data_bytes] = checksum;
+    response->protected_id = protected_id;
+    response->num_bytes = num_data_bytes + 1;
+    sei();
+    return true;
+  }
+
+  // Public. Called from main. See .h for description.
+  void clearSlaveResponse(uint8 id) {
+    SlaveResponse* const response = findSlaveResponseEntry(LinFrame::setLinIdChecksumBits(id));
+    if (response) {
+      // Single byte write, atomic.
+      response->num_bytes = 0;
+    }
+  }
+
+  // ----- Master Schedule Table -----
+
+  // Written by main with interrupts disabled. Read by ISR.
+  static ScheduleEntry schedule_entries[kMaxScheduleEntries];
+
+  // Number of entries in the running schedule, or zero if master mode is off.
+  // Written by main.
+  static volatile uint8 schedule_size;
+
+  // Index of the entry of the next slot. Read/Written by ISR, and by main with
+  // interrupts disabled.
+  static uint8 schedule_index;
+
+  // Start time and length of the current slot, in hardware clock ticks.
+  // Read/Written by ISR, and by main with interrupts disabled.
+  static uint16 slot_start_clock;
+  static uint16 slot_clock_ticks;
+
+  // Public. Called from main. See .h for description.
+  boolean setScheduleEntry(uint8 index, uint8 id, uint8 slot_millis,
+      const uint8* data, uint8 num_data_bytes) {
+    if (index >= kMaxScheduleEntries || slot_millis < 1 || slot_millis > kMaxSlotMillis
+        || num_data_bytes > LinFrame::kMaxBytes - 2) {
+      return false;
+    }
+    const uint8 protected_id = LinFrame::setLinIdChecksumBits(id);
+    const uint8 checksum = num_data_bytes ? computeChecksum(protected_id, data, num_data_bytes) : 0;
+
+    // The ISR copies the entry at the start of its slot so it never sees a
+    // partial update.
+    ScheduleEntry* const entry = &schedule_entries[index];
+    waitForIsrEnd();
+    cli();
+    for (uint8 i = 0; i < num_data_bytes; i++) {
+      entry->bytes[i] = data[i];
+    }
+    entry->bytes[num_data_bytes] = checksum;
+    entry->protected_id = protected_id;
+    entry->slot_clock_ticks = slot_millis * hardware_clock::kTicksPerMilli;
+    entry->num_bytes = num_data_bytes ? num_data_bytes + 1 : 0;
+    sei();
+    return true;
+  }
+
+  // Public. Called from main. See .h for description.
+  void startSchedule(uint8 num_entries) {
+    if (num_entries > kMaxScheduleEntries) {
+      num_entries = kMaxScheduleEntries;
+    }
+    waitForIsrEnd();
+    cli();
+    schedule_index = 0;
+    // The first slot starts right away.
+    slot_start_clock = hardware_clock::ticksForIsr();
+    slot_clock_ticks = 0;
+    schedule_size = num_entries;
+    sei();
+  }
+
+  // Public. Called from main. See .h for description.
+  void stopSchedule() {
+    // Single byte write, atomic.
+    schedule_size = 0;
+  }
+
+  // Return true if the next schedule slot should start. Called from ISR.
+  static inline boolean isScheduleSlotDue() {
+    // Should work also in case of 16 bit clock overflow.
+    return schedule_size && (uint16)(hardware_clock::ticksForIsr() - slot_start_clock) >= slot_clock_ticks;
+  }
+
+  // Advance to the next schedule slot and return its entry. Called from ISR.
+  static inline const ScheduleEntry& nextScheduleSlot() {
+    // Keep the slots aligned to the schedule, unless we are late by more than
+    // a slot (e.g. the schedule was just started or the bus was busy).
+    const uint16 elapsed = hardware_clock::ticksForIsr() - slot_start_clock;
+    if (elapsed < 2 * slot_clock_ticks) {
+      slot_start_clock += slot_clock_ticks;
+    } else {
+      slot_start_clock += elapsed;
+    }
+
+    const ScheduleEntry& entry = schedule_entries[schedule_index];
+    slot_clock_ticks = entry.slot_clock_ticks;
+    if (++schedule_index >= schedule_size) {
+      schedule_index = 0;
+    }
+    return entry;
+  }
+
   // ----- Initialization -----
 
   static void setupTimer() {    
@@ -438,6 +661,21 @@ namespace lin_processor {
     } 
   }
 
+  // ----- Frame Completion -----
+
+  // Called from ISR at the end of a frame that was read ok so far. Moves to the next
+  // frame in the ring buffer.
+  // NOTE: we will reset the byte_count of the new frame buffer next time we will enter data detect state.
+  // NOTE: verification of sync byte, id, checksum, etc is done latter by the main code, not the ISR.
+  static inline void completeFrame() {
+    incrementHeadFrameBuffer();
+    if (tail_frame_buffer == head_frame_buffer) {
+      // Frame buffer overrun. We drop the oldest frame and continue with this one.       
+      setErrorFlags(errors::BUFFER_OVERRUN);
+      incrementTailFrameBuffer();
+    }
+  }
+
   // ----- Detect-Break State Implementation -----
 
   uint8 StateDetectBreak::low_bits_counter_;
@@ -445,12 +683,18 @@ namespace lin_processor {
   inline void StateDetectBreak::enter() {
     state = states::DETECT_BREAK;
     low_bits_counter_ = 0;
+    // Make sure we don't assert a break on the lin bus.
+    tx1_pin::setHigh();
   }
 
   // Return true if enough time to service rx request.
   inline void StateDetectBreak::handleIsr() {
     if (rx_pin::isHigh()) {
       low_bits_counter_ = 0;
+      // In master mode, start the next slot when it's due and the bus is idle.
+      if (isScheduleSlotDue()) {
+        StateSendBytes::enterHeader(nextScheduleSlot());
+      }
       return;
     } 
 
@@ -491,6 +735,15 @@ namespace lin_processor {
     setTimerToHalfTick();   
   }
 
+  // Called at the end of the stop bit of an id byte we sent. The id byte is
+  // already in the frame buffer.
+  inline void StateReadData::enterAfterId() {
+    state = states::READ_DATA;
+    bytes_read_ = 2;
+    bits_read_in_byte_ = 0;
+    waitForNextByte();
+  }
+
   inline void StateReadData::handleIsr() {
     // Sample data bit ASAP to avoid jitter.
     sample_pin::setHigh();
@@ -555,6 +808,20 @@ namespace lin_processor {
       rx_frame_buffers[head_frame_buffer].append_byte(byte_buffer_);
     }
 
+    // If this is the id byte of an emulated slave, send the response.
+    if (bytes_read_ == 2) {
+      const SlaveResponse* const response = findSlaveResponse(byte_buffer_);
+      if (response) {
+        StateSendBytes::enterResponse(*response);
+        return;
+      }
+    }
+
+    waitForNextByte();
+  }
+
+  // Called after a byte was read ok. Determines if there are more bytes in the frame.
+  inline void StateReadData::waitForNextByte() {
     // Wait for the high to low transition of start bit of next byte.
     const boolean has_more_bytes =  waitForRxLow(config.clock_ticks_per_until_start_bit());
 
@@ -568,15 +835,7 @@ namespace lin_processor {
       }
 
       // Frame looks ok so far. Move to next frame in the ring buffer.
-      // NOTE: we will reset the byte_count of the new frame buffer next time we will enter data detect state.
-      // NOTE: verification of sync byte, id, checksum, etc is done latter by the main code, not the ISR.
-      incrementHeadFrameBuffer();
-      if (tail_frame_buffer == head_frame_buffer) {
-        // Frame buffer overrun. We drop the oldest frame and continue with this one.       
-        setErrorFlags(errors::BUFFER_OVERRUN);
-        incrementTailFrameBuffer();
-      }
-
+      completeFrame();
       StateDetectBreak::enter();
       return;
     }
@@ -597,6 +856,125 @@ namespace lin_processor {
     setTimerToHalfTick();
   }
 
+  // ----- Send-Bytes State Implementation -----
+
+  uint8 StateSendBytes::tx_buffer_[LinFrame::kMaxBytes + 1];
+  uint8 StateSendBytes::tx_bytes_;
+  uint8 StateSendBytes::first_appended_byte_;
+  boolean StateSendBytes::receive_response_;
+  uint8 StateSendBytes::bytes_sent_;
+  uint8 StateSendBytes::break_slots_left_;
+  uint8 StateSendBytes::slot_;
+  boolean StateSendBytes::is_tx_high_;
+  uint8 StateSendBytes::next_slot_;
+  boolean StateSendBytes::next_tx_high_;
+
+  inline void StateSendBytes::enterResponse(const SlaveResponse& response) {
+    state = states::SEND_BYTES;
+    tx_bytes_ = response.num_bytes;
+    for (uint8 i = 0; i < tx_bytes_; i++) {
+      tx_buffer_[i] = response.bytes[i];
+    }
+    first_appended_byte_ = 0;
+    receive_response_ = false;
+    bytes_sent_ = 0;
+
+    // The slot in progress is the stop bit of the id byte, sent by the master.
+    // It is treated as a space slot so it is not verified.
+    slot_ = kSpaceSlot;
+    is_tx_high_ = true;
+    next_slot_ = kSpaceSlot;
+    next_tx_high_ = true;
+
+    // We are in the middle of the stop bit. Have the next tick at its end, and
+    // from there on at the bit boundaries.
+    setTimerToHalfTick();
+  }
+
+  inline void StateSendBytes::enterHeader(const ScheduleEntry& entry) {
+    state = states::SEND_BYTES;
+    rx_frame_buffers[head_frame_buffer].reset();
+    tx_buffer_[0] = 0x55;
+    tx_buffer_[1] = entry.protected_id;
+    for (uint8 i = 0; i < entry.num_bytes; i++) {
+      tx_buffer_[2 + i] = entry.bytes[i];
+    }
+    tx_bytes_ = 2 + entry.num_bytes;
+    // The sync byte is not appended to the frame buffer.
+    first_appended_byte_ = 1;
+    receive_response_ = !entry.num_bytes;
+    bytes_sent_ = 0;
+    break_slots_left_ = kBreakBits;
+
+    // The bus is idle. The break starts at the next tick, one bit from now, and
+    // from there on the ticks are at the bit boundaries.
+    slot_ = kSpaceSlot;
+    is_tx_high_ = true;
+    next_slot_ = kBreakSlot;
+    next_tx_high_ = false;
+  }
+
+  inline void StateSendBytes::handleIsr() {
+    // Sample the slot that ends now and start the next one. Both are done first,
+    // at a fixed delay from the tick, for accurate bit timing. Sampling at the
+    // end of the slot allows for the transciever loop delay.
+    const uint8 is_rx_high = rx_pin::isHigh();
+    if (next_tx_high_) {
+      tx1_pin::setHigh();
+    } else {
+      tx1_pin::setLow();
+    }
+
+    // Verify that the bus followed the level we sent in the slot that just ended.
+    if (slot_ != kSpaceSlot && (is_rx_high ? !is_tx_high_ : is_tx_high_)) {
+      setErrorFlags(errors::TX_COLLISION);
+      StateDetectBreak::enter();
+      return;
+    }
+
+    // If the stop bit of a byte just ended, the byte is done.
+    if (slot_ == kStopSlot) {
+      if (bytes_sent_ >= first_appended_byte_) {
+        rx_frame_buffers[head_frame_buffer].append_byte(tx_buffer_[bytes_sent_]);
+      }
+      if (++bytes_sent_ >= tx_bytes_) {
+        if (!receive_response_) {
+          completeFrame();
+          StateDetectBreak::enter();
+          return;
+        }
+        // Here when we sent a header with no data. The response may come from
+        // an emulated slave or from the bus.
+        const SlaveResponse* const response = findSlaveResponse(tx_buffer_[1]);
+        if (response) {
+          enterResponse(*response);
+        } else {
+          StateReadData::enterAfterId();
+        }
+        return;
+      }
+    }
+
+    slot_ = next_slot_;
+    is_tx_high_ = next_tx_high_;
+
+    // Prepare the slot that follows the one that just started.
+    if (slot_ == kBreakSlot) {
+      // The break is followed by a one bit delimiter.
+      const boolean is_last_break_slot = (--break_slots_left_ == 0);
+      next_slot_ = is_last_break_slot ? kSpaceSlot : kBreakSlot;
+      next_tx_high_ = is_last_break_slot;
+    } else if (slot_ >= kStopSlot) {
+      // After the space or the stop bit, the start bit of the next byte, if any.
+      next_slot_ = kStartSlot;
+      next_tx_high_ = (slot_ == kStopSlot) && (bytes_sent_ + 1 >= tx_bytes_);
+    } else {
+      // Data bits, lsb first, then the stop bit.
+      next_slot_ = slot_ + 1;
+      next_tx_high_ = (next_slot_ == kStopSlot) || (tx_buffer_[bytes_sent_] & bitMask(slot_));
+    }
+  }
+
   // ----- ISR Handler -----
 
   // Interrupt on Timer 2 A-match.
@@ -611,6 +989,9 @@ namespace lin_processor {
     case states::READ_DATA:
       StateReadData::handleIsr();
       break;
+    case states::SEND_BYTES:
+      StateSendBytes::handleIsr();
+      break;
     default:
       setErrorFlags(errors::OTHER);
       StateDetectBreak::enter();
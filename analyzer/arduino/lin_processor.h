@@ -21,7 +21,9 @@
 // * OC2B (PD3) - timer output ticks. For debugging. If needed, can be changed
 //   to not using this pin.
 // * PD2 - LIN RX input.
-// * PC0, PC1, PC2, PC3 - debugging outputs. See .cpp file for details.
+// * PC2 - LIN TX output. Used to send emulated slave responses and master
+//   headers.
+// * PC0, PC1, PC3 - debugging outputs. See .cpp file for details.
 namespace lin_processor {
   // Call once in program setup. 
   extern void setup();
@@ -41,6 +43,7 @@ namespace lin_processor {
     static const uint8 SYNC_BYTE = (1 << 4);
     static const uint8 BUFFER_OVERRUN = (1 << 5);
     static const uint8 OTHER = (1 << 6);
+    static const uint8 TX_COLLISION = (1 << 7);
   }
 
   // Get current error flag and clear it. 
@@ -48,6 +51,61 @@ namespace lin_processor {
   
   // Print to sio a list of error flags.
   extern void printErrorFlags(uint8 lin_errors);
+
+  // ----- Slave Response Emulation -----
+  //
+  // The ISR responds to headers of the configured ids with the given data and a
+  // precomputed checksum, as a slave would. The response is sent on the bit ticks
+  // after one bit of response space and each bit is read back from the bus. A
+  // mismatch (e.g. another slave responding) aborts the response with a
+  // TX_COLLISION error. Emulated frames are returned by readNextFrame() like any
+  // other frame.
+
+  // Max number of ids with emulated responses.
+  static const uint8 kMaxSlaveResponses = 4;
+
+  // Set or update the response to send for the given id. id is either the 6 bit
+  // id or the id byte with the parity bits. num_data_bytes is 1 to 8. The new
+  // data is used from the next header of this id. Returns false if the arguments
+  // are out of range or if all the kMaxSlaveResponses entries are in use.
+  // Called from main only.
+  extern boolean setSlaveResponse(uint8 id, const uint8* data, uint8 num_data_bytes);
+
+  // Stop responding to the given id. Called from main only.
+  extern void clearSlaveResponse(uint8 id);
+
+  // ----- Master Schedule -----
+  //
+  // In master mode, the ISR runs a schedule table. At the start of each slot it
+  // sends a break, sync and id byte on the bit ticks, followed by either the data
+  // of the slot (master published frame) or by the response of the slave, read
+  // like any other frame (or emulated, see above). Slot start times are kept by the
+  // hardware clock without accumulating drift. A slot starts only when the bus
+  // is idle, so slots should be longer than their frames.
+
+  // Max number of entries in the schedule table.
+  static const uint8 kMaxScheduleEntries = 8;
+
+  // Max length of a schedule slot.
+  static const uint8 kMaxSlotMillis = 100;
+
+  // Set the schedule table entry with the given index. id is either the 6 bit id or
+  // the id byte with the parity bits. slot_millis is the time from the start of
+  // this slot to the start of the next one, 1 to kMaxSlotMillis. num_data_bytes is 0
+  // if the response is sent by a slave or 1 to 8 for master published data.
+  // Returns false if the arguments are out of range. Can be called also while
+  // the schedule is running, the entry is used from its next slot.
+  // Called from main only.
+  extern boolean setScheduleEntry(uint8 index, uint8 id, uint8 slot_millis,
+      const uint8* data, uint8 num_data_bytes);
+
+  // Start running the first num_entries entries of the schedule table, from the
+  // first one. Called from main only.
+  extern void startSchedule(uint8 num_entries);
+
+  // Stop the schedule. The current frame, if any, is completed. Called from main
+  // only.
+  extern void stopSchedule();
 }
 
 #endif  
@@ -15,45 +15,29 @@
 
 #include <arduino.h>
 #include "io_pins.h"
-#include "passive_timer.h"
+#include "timer_wheel.h"
 
-// Wrapes an OutputPin with logic to blick an LED while some events occur. Design
+// Wrapes an io_pins::Pin with logic to blick an LED while some events occur. Design
 // to be visible regardless of the event frequency and duration.
-// Requires loop() calls from main loop().
+// The state transitions are done by a timer_wheel timer.
+template <class LedPin>
 class ActionLed {
 public:
-  ActionLed(volatile uint8& port, uint8 bitIndex) 
-    : led_(port, bitIndex),
+  // LedPin is the underlying pin of the led. Active high.
+  ActionLed() 
+    : timer_(onTimer, this),
       pending_actions_(false) {
+    LedPin::setupOutput(false);
     enterIdleState();
   }
   
-  // Called periodically from main loop() to do the state transitions. 
-  void loop() {
-    switch (state_) {
-      case kState_IDLE:
-      if (pending_actions_) {
-        enterActiveOnState();
-        pending_actions_ = false;
-      }
-      break;
-
-      case kState_ACTIVE_ON:
-        if (timer_.timeMillis() > 20) {
-          enterActiveOffState();
-        }
-      break;
-      case kState_ACTIVE_OFF:
-      if (timer_.timeMillis() > 30) {
-          // NOTE: if pending_actions_ then will enter ACTIVE_ON on next iteration.
-          enterIdleState();
-        }
-      break;  
-    }
-  }
-  
   void action() {
-    pending_actions_ = true;  
+    // NOTE: if not idle then will enter ACTIVE_ON at the end of the ACTIVE_OFF period.
+    if (state_ == kState_IDLE) {
+      enterActiveOnState();
+    } else {
+      pending_actions_ = true;
+    }
   }
   
 private:
@@ -66,34 +50,41 @@ private:
    static const uint8 kState_ACTIVE_OFF = 3; 
    uint8 state_; 
   
-  // The underlying pin of the led. Active high.
-  io_pins::OutputPin led_;
-  
   // A timer for the ACtIVE_ON and ACTIVE_OFF periods.
-  PassiveTimer timer_;
+  timer_wheel::Timer timer_;
   
   // Indicates if a new action arrived.
   boolean pending_actions_;
+
+  // Called by timer_ at the end of the ACTIVE_ON and ACTIVE_OFF periods.
+  static void onTimer(void* context) {
+    ActionLed* const action_led = (ActionLed*)context;
+    if (action_led->state_ == kState_ACTIVE_ON) {
+      action_led->enterActiveOffState();
+    } else if (action_led->pending_actions_) {
+      action_led->pending_actions_ = false;
+      action_led->enterActiveOnState();
+    } else {
+      action_led->enterIdleState();
+    }
+  }
   
   inline void enterIdleState() {
     state_ = kState_IDLE;
-    led_.low();
+    LedPin::setLow();
   }
   
   inline void enterActiveOnState() {
     state_ = kState_ACTIVE_ON;
-    led_.high();
-    timer_.restart();
-    
+    LedPin::setHigh();
+    timer_.start(21);
   }
   
   inline void enterActiveOffState() {
     state_ = kState_ACTIVE_OFF;
-    led_.low();
-    timer_.restart();
+    LedPin::setLow();
+    timer_.start(31);
   }
 };
 
 #endif  
-
-
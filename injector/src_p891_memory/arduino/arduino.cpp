@@ -13,12 +13,18 @@
 #include "avr_util.h"
 #include "custom_defs.h"
 #include "custom_module.h"
+#include "eeprom_writer.h"
+#include "gateway.h"
 #include "hardware_clock.h"
 #include "io_pins.h"
 #include "leds.h"
 #include "lin_processor.h"
+#include "lin_sniffer.h"
+#include "passive_timer.h"
+#include "settings.h"
 #include "sio.h"
 #include "system_clock.h"
+#include "timer_wheel.h"
 
 // Arduino setup function. Called once during initialization.
 void setup()
@@ -27,73 +33,171 @@ void setup()
   // Initialize this first since some setup methods uses it.
   sio::setup();
 
-  // Uses Timer1, no interrupts.
+  // Uses Timer1 with its overflow interrupt.
   hardware_clock::setup();
 
-  // Uses Timer2 with interrupts, and a few i/o pins. See source code for details.
-  lin_processor::setup();
-  
-  custom_module::setup();
+  // Initialize this before the modules that start timers.
+  timer_wheel::setup();
+
+  // The status led pin. The other leds need no setup.
+  leds::setup();
+
+  if (custom_defs::kUseDualBusSniffer) {
+    // Uses Timer2 with interrupts, and the LIN i/o pins. The injector modules are
+    // not used.
+    lin_sniffer::setup();
+  } else {
+    // Uses Timer2 with interrupts, and a few i/o pins. See source code for details.
+    lin_processor::setup();
+
+    // Should be done before enabling interrupts since the ISR uses it.
+    gateway::setup();
+
+    // Writes to the eeprom from the main loop, without blocking.
+    eeprom_writer::setup();
+
+    // Reads the settings from the eeprom. Should be done before custom_module
+    // which uses them.
+    settings::setup();
+
+    custom_module::setup();
+  }
 
-  // Enable global interrupts. We expect to have only timer1 interrupts by
-  // the lin processor to reduce ISR jitter.
+  // Enable global interrupts. We expect to have only timer2 interrupts by
+  // the lin processor and the rare timer1 overflow interrupt of the hardware
+  // clock, to reduce ISR jitter.
   sei(); 
   
   // Have an early 'waiting' led bling to indicate normal operation.
   leds::frames.action(); 
 }
 
+// Prints a periodic text message if no activity. Restarted by the activity.
+static void onIdleTimer(void* context) {
+  // Slow blinking indicates waiting.
+  leds::frames.action(); 
+  sio::println(F("waiting..."));
+}
+static timer_wheel::Timer idle_timer(onIdleTimer, NULL);
+static const uint16 kIdleTimerMillis = 3000;
+
+// Handles the LIN error flags of the lin_processor or the sniffer, whichever
+// is used. Accomulates the flags and prints them at most once a second.
+static void handleLinErrors(uint8 new_lin_errors) {
+  // Used to trigger periodic error printing.
+  static PassiveTimer lin_errors_timeout;
+  // Accomulates error flags until next printing.
+  static uint8 pending_lin_errors = 0;
+
+  if (new_lin_errors) {
+    // Make the ERRORS led blinking.
+    leds::errors.action();
+    idle_timer.startPeriodic(kIdleTimerMillis);
+  }
+
+  // If pending errors and time to print errors then print and clear.
+  pending_lin_errors |= new_lin_errors;
+  if (pending_lin_errors && lin_errors_timeout.timeMillis() > 1000) {
+    sio::print(F("LIN errors: "));
+    lin_processor::printErrorFlags(pending_lin_errors);
+    sio::println();
+    lin_errors_timeout.restart();
+    pending_lin_errors = 0;
+  }
+}
+
+// The loop() of the sniffer personality. Dumps the frames of the two channels,
+// tagged with their channel and the system time of the end of their break.
+// Never returns.
+static void snifferLoop()
+{
+  idle_timer.startPeriodic(kIdleTimerMillis);
+  for(;;) {
+    system_clock::loop();
+    sio::loop();
+    timer_wheel::loop();
+
+    // Handle sniffer error flags.
+    handleLinErrors(lin_sniffer::getAndClearErrorFlags());
+
+    // Handle recieved LIN frames.
+    LinFrame frame;
+    uint8 channel;
+    uint32 timestamp;
+    if (lin_sniffer::readNextFrame(&frame, &channel, &timestamp)) {
+      // The frame timestamp is in 32 bit hardware clock ticks, so this is
+      // correct for frames up to hours old.
+      const uint32 age_ticks = hardware_clock::ticks32ForNonIsr() - timestamp;
+      const uint32 time_millis = system_clock::timeMillis()
+          - (age_ticks / hardware_clock::kTicksPerMilli);
+
+      checksum_models::learnFrame(frame);
+      const boolean frameOk = frame.isValid();
+      if (frameOk) {
+        leds::frames.action();
+      } else {
+        leds::errors.action();
+      }
+
+      sio::printf(F("%lu %u:"), time_millis, channel);
+      for (int i = 0; i < frame.num_bytes(); i++) {
+        sio::printchar(' ');
+        sio::printhex2(frame.get_byte(i));
+      }
+      if (!frameOk) {
+        sio::print(F(" ERR"));
+      }
+      sio::println();
+
+      idle_timer.startPeriodic(kIdleTimerMillis);
+    }
+  }
+}
+
+// Echo mismatch counts by 6 bit frame id, saturated at 255. Main only.
+static uint8 echo_mismatches_by_id[64];
+static boolean has_echo_mismatches = false;
+
 // Arduino loop() method. Called after setup(). Never returns.
 // This is a quick loop that does not use delay() or other busy loops or 
 // blocking calls.
 void loop()
 {
+  if (custom_defs::kUseDualBusSniffer) {
+    snifferLoop();
+  }
+
   // Having our own loop shaves about 4 usec per iteration. It also eliminate
   // any underlying functionality that we may not want.
+  idle_timer.startPeriodic(kIdleTimerMillis);
   for(;;) {    
-    // Periodic updates.
+    // Periodic updates. The timers, including those of the leds, are
+    // dispatched by timer_wheel.
     system_clock::loop();    
     sio::loop();
-    leds::loop(); 
+    timer_wheel::loop();
+    eeprom_writer::loop();
     custom_module::loop();
 
-    // Print a periodic text messages if no activiy.
-    static PassiveTimer idle_timer;
-    if (idle_timer.timeMillis() >= 3000) {
-      // Slow blinking indicates waiting.
-      leds::frames.action(); 
-      sio::println(F("waiting..."));
-      idle_timer.restart();
-    }
-
     // Handle LIN processor error flags.
+    handleLinErrors(lin_processor::getAndClearErrorFlags());
+
+    // Handle eeprom writer error flags. These are rare so are printed as they
+    // occur.
     {
-      // Used to trigger periodic error printing.
-      static PassiveTimer lin_errors_timeout;
-      // Accomulates error flags until next printing.
-      static uint8 pending_lin_errors = 0;
-      
-      const uint8 new_lin_errors = lin_processor::getAndClearErrorFlags();
-      if (new_lin_errors) {
-        // Make the ERRORS led blinking.
+      const uint8 eeprom_errors = eeprom_writer::getAndClearErrorFlags();
+      if (eeprom_errors) {
         leds::errors.action();
-        idle_timer.restart();
-      }
-
-      // If pending errors and time to print errors then print and clear.
-      pending_lin_errors |= new_lin_errors;
-      if (pending_lin_errors && lin_errors_timeout.timeMillis() > 1000) {
-        sio::print(F("LIN errors: "));
-        lin_processor::printErrorFlags(pending_lin_errors);
+        sio::print(F("EEPROM errors: "));
+        eeprom_writer::printErrorFlags(eeprom_errors);
         sio::println();
-        lin_errors_timeout.restart();
-        pending_lin_errors = 0;
       }
     }
     
     // Handle recieved LIN frames.
     LinFrame frame;
     if (lin_processor::readNextFrame(&frame)) {
+      checksum_models::learnFrame(frame);
       const boolean frameOk = frame.isValid();
       if (frameOk) {
         // Make the FRAMES led blinking.
@@ -112,9 +216,14 @@ void loop()
         }
         sio::printhex2(frame.get_byte(i));  
       }
+      sio::printchar(' ');
+      sio::printchar(LinFrame::publisherLetter(frame.publisher()));
       if (frame.hasInjectedBits()) {
         sio::print(F(" *"));
       }
+      if (frame.echo_mismatches()) {
+        sio::printf(F(" E%u"), frame.echo_mismatches());
+      }
 
       if (!frameOk) {
         sio::print(F(" ERR"));
@@ -123,7 +232,7 @@ void loop()
 #endif
 
       // Supress the 'waiting' messages.
-      idle_timer.restart(); 
+      idle_timer.startPeriodic(kIdleTimerMillis); 
 
       // Inform the custom module about the incoming frame in case it
       // needs to intercept signals. This call by itself does not do signal
@@ -132,6 +241,31 @@ void loop()
       if (frameOk) {
         custom_module::frameArrived(frame);
       }
+
+      // Accomulate the echo mismatches of the frame id until next printing.
+      if (custom_defs::kUseEchoVerify && frame.num_bytes()) {
+        const uint8 id = frame.get_byte(0) & 0x3f;
+        const uint16 sum = echo_mismatches_by_id[id] + frame.echo_mismatches();
+        echo_mismatches_by_id[id] = (sum > 255) ? 255 : sum;
+        has_echo_mismatches |= (sum != 0);
+      }
+    }
+
+    // Print and clear the echo mismatch counts of the frame ids that had any.
+    if (custom_defs::kUseEchoVerify) {
+      static PassiveTimer echo_mismatches_timeout;
+      if (has_echo_mismatches && echo_mismatches_timeout.timeMillis() > 1000) {
+        sio::print(F("Echo mismatches:"));
+        for (uint8 id = 0; id < ARRAY_SIZE(echo_mismatches_by_id); id++) {
+          if (echo_mismatches_by_id[id]) {
+            sio::printf(F(" %02x:%u"), id, echo_mismatches_by_id[id]);
+            echo_mismatches_by_id[id] = 0;
+          }
+        }
+        sio::println();
+        echo_mismatches_timeout.restart();
+        has_echo_mismatches = false;
+      }
     }
   }
 }
@@ -16,6 +16,8 @@
 
 #include "custom_signals.h"
 #include "passive_timer.h"
+#include "settings.h"
+#include "signal_events.h"
 #include "sio.h"
 
 // Like all the other custom_* files, this file should be adapted to the specific application. 
@@ -49,15 +51,23 @@ namespace custom_config {
   // Time in current state.
   static PassiveTimer time_in_state;
 
-  // Arbitrary 16bit code to store in the eeprom for on/off state.
+  // Number of config button clicks in the IGNITION_ON_COUNTING state.
+  static uint8 button_click_count;
+
+  // Arbitrary 16bit code to store in the settings for on/off state.
   namespace eeprom_uint16_code {
     static const uint16 ENABLED = 0x1234;
     static const uint16 DISABLED = 0x4568;
   }
 
-  // Set is_enabled flag from the configuration stored in the eeprom.
+  // Before the settings store, the code was in this eeprom word. Used until
+  // the config is toggled.
+  static uint16* const kLegacyEepromCodeAddr = (uint16*)0;
+
+  // Set is_enabled flag from the configuration stored in the settings.
   static inline void loadEepromConfig() {
-    const uint16 eeprom_code = eeprom_read_word(0);
+    const uint16 eeprom_code = settings::get(settings::keys::CONFIG_CODE,
+        eeprom_read_word(kLegacyEepromCodeAddr));
 
     // If the code is unknown we default to enabled.
     private_::is_enabled = eeprom_code != eeprom_uint16_code::DISABLED;
@@ -68,13 +78,13 @@ namespace custom_config {
   static inline void toggleConfig() {
     // Toggle the eeprom code.
     const uint16 eeprom_code = (private_::is_enabled) ? eeprom_uint16_code::DISABLED : eeprom_uint16_code::ENABLED;
-    eeprom_write_word(0, eeprom_code);
+    settings::set(settings::keys::CONFIG_CODE, eeprom_code);
     sio::printf(F("config toggled\n"));
 
     // TODO: if the writing failed surface an error condition.
 
-    // Read the new eeprom code. If writing to the eeprom failed, we
-    // will stay with the actual config stored in the eeprom.
+    // Read the new code. If its write could not be queued, we
+    // will stay with the actual config stored in the settings.
     loadEepromConfig();
   }
 
@@ -85,23 +95,34 @@ namespace custom_config {
     time_in_state.restart();
   }
 
+  // Count the clicks from the button edges. A click is a change from non
+  // pressed to pressed.
+  static void onSignalEvent(const signal_events::SignalEvent& event) {
+    if (state != states::IGNITION_ON_COUNTING
+        || event.signal_id != custom_signals::signal_ids::CONFIG_BUTTON
+        || event.old_state != SignalTracker::States::OFF
+        || event.new_state != SignalTracker::States::ON) {
+      return;
+    }
+    // This cannot overflow because we exist the counting state if exceeding kExpectedButtonClicks.
+    button_click_count++;
+    sio::printf(F("config state: %d.%d at %lu\n"), states::IGNITION_ON_COUNTING, button_click_count,
+        event.time_millis);
+  }
+
   void setup() {
     loadEepromConfig();
     changeToState(states::IGNITION_OFF_IDLE);
+    signal_events::subscribe(onSignalEvent);
   }
 
   // Called periodically from loop() to update the state machine.
   static inline void updateState() {
-    // Valid in IGNITION_ON_COUNTING state only.
-    static uint8 button_click_count;
-    static uint8 button_last_state;
-
     // Handle the state transitions.
     switch (state) {
       case states::IGNITION_OFF_IDLE:
         if (custom_signals::ignition_state().isOn()) {
           button_click_count = 0;
-          button_last_state = custom_signals::config_button().state();
           changeToState(states::IGNITION_ON_COUNTING);  
         }
         break;
@@ -121,15 +142,7 @@ namespace custom_config {
                 : states::IGNITION_OFF_IDLE);
             break;
           }
-  
-          const uint8 button_new_state = custom_signals::config_button().state();
-          // Count change from non pressed to pressed.
-          if ((button_last_state == SignalTracker::States::OFF) && (button_new_state == SignalTracker::States::ON)) {
-            // This cannot overflow because we exist this state if exceeding kExpectedButtonClicks. 
-            button_click_count++;
-            sio::printf(F("config state: %d.%d\n"), states::IGNITION_ON_COUNTING, button_click_count);
-          }
-          button_last_state = button_new_state;
+          // The clicks are counted by onSignalEvent().
         }
         break;
 
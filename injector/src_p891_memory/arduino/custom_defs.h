@@ -28,6 +28,30 @@ namespace custom_defs {
   // Supported baud range is 1000 to 20000. If out of range, using silently default
   // baud of 9600.
   const uint16 kLinSpeed = 19200;
+
+  // True to assume the LIN 1.x frame length convention (2, 4 or 8 data bytes
+  // by bits 5:4 of the frame id) for ids whose length was not configured or
+  // learned yet. Many LIN 2.x buses, including the 981 console, do not follow it.
+  const boolean kUseLin1xFrameLengths = false;
+
+  // True to proxy bytes that are not modified by the injector by following the
+  // rx edges, with a propagation delay of a few CPU cycles. False to proxy all
+  // bytes by sampling in the middle of the bit, which delays the output by half
+  // a bit. Following keeps the ISR busy for half of each bit of the followed
+  // bytes, see Config in lin_processor.cpp.
+  const boolean kUseEdgeFollowingProxy = false;
+
+  // True to run the board as a two channel bus analyzer (lin_sniffer) instead of
+  // an injector. Each LIN interface is decoded as an independent bus and the
+  // frames are dumped with their channel and time.
+  const boolean kUseDualBusSniffer = false;
+
+  // True to verify the proxied bits. On each bit tick the injector samples the
+  // echo of the side it transmits to and counts the bits that differ from the
+  // level it drove, e.g. due to a bus conflict or an injected recessive bit that
+  // is overridden by a dominant driver. The counts are kept per frame and are
+  // reported per frame id.
+  const boolean kUseEchoVerify = false;
   
 }  // namepsace custom_defs
 
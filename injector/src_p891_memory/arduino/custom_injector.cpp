@@ -12,6 +12,11 @@
 
 #include "custom_injector.h"
 
+#include <avr/eeprom.h>
+
+#include "eeprom_writer.h"
+#include "sio.h"
+
 // The state variables of the injector.
 //
 // Like all the other custom_* files, this file should be adapted to the specific application. 
@@ -21,21 +26,358 @@ namespace custom_injector {
   // Private state of the injector. Do not use from other files.
   namespace private_ {
 
-    byte sport_inject_action = injector_actions::COPY_BIT;
-    byte PSE_inject_action = injector_actions::COPY_BIT;
-    byte ASS_inject_action = injector_actions::COPY_BIT;
+    // Initialized by setup().
+    RuleSet rule_sets[2];
+    volatile uint8 active_rule_set;
+    volatile boolean swap_requested;
+    volatile uint8 cancel_state;
     
-    // True if the current linbus frame is transformed by the injector. Othrwise, the 
-    // frame is passed as is.
-    boolean frame_id_matches;
+    // Initialized by setup().
+    uint8 frame_data_bytes_by_id[kNumFrameIds];
+
+    // The rule of the current linbus frame or NULL if the frame is passed as is.
+    const Rule* current_rule;
     
-    // Used to calculate the modified frame checksum.
-    uint16 sum;
+    uint8 frame_data_bytes;
     
-    // The modified frame checksum byte. 
-    uint8 checksum;
+    // Data length of frame ids that are known in advance. These are never
+    // modified by learning.
+    struct FrameLength {
+      const uint8 id;
+      const uint8 data_bytes;
+    };
+
+    static const FrameLength kConfiguredFrameLengths[] PROGMEM = {
+      { kTargetedFrameId, 8 },
+    };
+
+    // Eeprom location of the learned data lengths, one byte per 6 bit id. Bytes
+    // 0-4 are used by custom_config and custom_module.
+    static uint8* const kEepromFrameLengthsAddr = (uint8*) 16;
+
+    // Number of consecutive valid frames with the same new length that are
+    // required to change an already known length.
+    static const uint8 kRequiredLengthReports = 3;
+
+    // A pending change of a known frame length. Main thread only.
+    static uint8 pending_length_id;
+    static uint8 pending_length_data_bytes;
+    static uint8 pending_length_reports;
+
+    // Set the expected data lengths of all ids from, by priority, the
+    // configuration, the eeprom and optionally the LIN 1.x convention.
+    static void setupFrameLengths() {
+      for (uint8 id = 0; id < kNumFrameIds; id++) {
+        uint8 data_bytes = eeprom_read_byte(kEepromFrameLengthsAddr + id);
+        // Erased or corrupted eeprom cells read as unknown.
+        if (data_bytes < 1 || data_bytes > kMaxDataBytes) {
+          data_bytes = 0;
+        }
+        if (!data_bytes && custom_defs::kUseLin1xFrameLengths) {
+          data_bytes = (id < 0x20) ? 2 : (id < 0x30) ? 4 : 8;
+        }
+        frame_data_bytes_by_id[id] = data_bytes;
+      }
+      for (uint8 i = 0; i < ARRAY_SIZE(kConfiguredFrameLengths); i++) {
+        const uint8 id = pgm_read_byte(&kConfiguredFrameLengths[i].id) & 0x3f;
+        const uint8 data_bytes = pgm_read_byte(&kConfiguredFrameLengths[i].data_bytes);
+        frame_data_bytes_by_id[id] = data_bytes | kDataBytesFixed;
+      }
+      pending_length_reports = 0;
+    }
+
+    // The ones' complement sum of the modified frame bytes so far.
+    uint8 sum;
+
+    // The ones' complement sum of the original frame bytes so far.
+    uint8 original_sum;
+
+    // The expected checksum byte of the original frame.
+    uint8 original_checksum;
+
+    // The checksum bits that differ between the original and modified frames.
+    uint8 checksum_delta;
+
+    volatile uint8 valid_frames_count;
+    volatile uint8 invalid_frames_count;
+
+    // Values of valid_frames_count and invalid_frames_count that were already
+    // accumulated. Main thread only.
+    static uint8 accounted_valid_frames_count;
+    static uint8 accounted_invalid_frames_count;
+
+    // Accumulated frame counters. Main thread only.
+    static uint32 total_valid_frames;
+    static uint32 total_invalid_frames;
+
+    // Return true if the given rule modifies at least one bit.
+    static boolean hasModifiedBits(const Rule& rule) {
+      for (uint8 i = 0; i < kMaxDataBytes; i++) {
+        if (rule.force_masks[i] | rule.invert_masks[i]) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // True if the shadow rule set is older than the active one and needs to be
+    // refreshed before it is modified. Main thread only.
+    static boolean shadow_is_stale;
+
+    // True if the shadow rule set has changes that were not committed yet. Main
+    // thread only.
+    static boolean shadow_is_modified;
+
+    // Return the rule set that the main thread can modify or NULL if a commit is
+    // still pending. The ISR never reads the returned set until the next commit.
+    static RuleSet* editableRuleSet() {
+      if (swap_requested || cancel_state != cancel_states::IDLE) {
+        return NULL;
+      }
+      RuleSet* const shadow = &rule_sets[active_rule_set ^ 1];
+      if (shadow_is_stale) {
+        // The ISR only reads the active set so copying it here is safe.
+        *shadow = rule_sets[active_rule_set];
+        shadow_is_stale = false;
+      }
+      return shadow;
+    }
+
+    // Return the index of a rule of the given set that is not mapped to any id or
+    // kNoRule if all the rules are in use.
+    static uint8 findFreeRule(const RuleSet& rule_set) {
+      for (uint8 rule_index = 0; rule_index < kMaxRules; rule_index++) {
+        boolean in_use = false;
+        for (uint8 id = 0; id < kNumFrameIds; id++) {
+          if (rule_set.rule_index_by_id[id] == rule_index) {
+            in_use = true;
+            break;
+          }
+        }
+        if (!in_use) {
+          return rule_index;
+        }
+      }
+      return kNoRule;
+    }
+
+    // Set the transform of the bits in mask of the given data byte. Bits in both
+    // mask and force_mask are replaced with the respective bits of force_value,
+    // bits in both mask and invert_mask are inverted and other bits in mask are
+    // passed as is. Bits not in mask are not changed.
+    static boolean updateByteTransform(uint8 id, uint8 byte_index, uint8 mask,
+        uint8 force_mask, uint8 force_value, uint8 invert_mask) {
+      if (byte_index >= kMaxDataBytes) {
+        return false;
+      }
+
+      RuleSet* const rule_set = editableRuleSet();
+      if (!rule_set) {
+        return false;
+      }
+
+      force_mask &= mask;
+      invert_mask &= mask & ~force_mask;
+
+      const uint8 id6 = id & 0x3f;
+      uint8 rule_index = rule_set->rule_index_by_id[id6];
+
+      // Copying the bits of an id with no rule is the default behavior.
+      if (rule_index == kNoRule && !force_mask && !invert_mask) {
+        return true;
+      }
+
+      Rule* rule;
+      if (rule_index == kNoRule) {
+        rule_index = findFreeRule(*rule_set);
+        if (rule_index == kNoRule) {
+          return false;
+        }
+        rule = &rule_set->rules[rule_index];
+        for (uint8 i = 0; i < kMaxDataBytes; i++) {
+          rule->force_masks[i] = 0;
+          rule->force_values[i] = 0;
+          rule->invert_masks[i] = 0;
+        }
+        rule->protected_id = LinFrame::setLinIdChecksumBits(id6);
+        rule_set->rule_index_by_id[id6] = rule_index;
+      } else {
+        rule = &rule_set->rules[rule_index];
+      }
+      shadow_is_modified = true;
+
+      rule->force_masks[byte_index] = (rule->force_masks[byte_index] & ~mask) | force_mask;
+      rule->force_values[byte_index] = (rule->force_values[byte_index] & ~mask)
+          | (force_value & force_mask);
+      rule->invert_masks[byte_index] = (rule->invert_masks[byte_index] & ~mask) | invert_mask;
+
+      // Release rules that no longer modify any bit so frames with this id are
+      // passed as is.
+      if (!hasModifiedBits(*rule)) {
+        rule_set->rule_index_by_id[id6] = kNoRule;
+        return true;
+      }
+
+      // Recompute once here so the ISR needs a single compare per byte.
+      rule->first_modified_byte = 0;
+      while (!(rule->force_masks[rule->first_modified_byte]
+          | rule->invert_masks[rule->first_modified_byte])) {
+        rule->first_modified_byte++;
+      }
+      return true;
+    }
   }
-}  // namepsace custom_injector
 
+  boolean setBitAction(uint8 id, uint8 byte_index, uint8 bit_index, uint8 action) {
+    if (bit_index > 7) {
+      return false;
+    }
 
+    const uint8 mask = bitMask(bit_index);
+    switch (action) {
+      case injector_actions::FORCE_BIT_1:
+        return private_::updateByteTransform(id, byte_index, mask, mask, 0xff, 0);
+      case injector_actions::FORCE_BIT_0:
+        return private_::updateByteTransform(id, byte_index, mask, mask, 0x00, 0);
+      case injector_actions::INVERT_BIT:
+        return private_::updateByteTransform(id, byte_index, mask, 0, 0, mask);
+      default:
+        return private_::updateByteTransform(id, byte_index, mask, 0, 0, 0);
+    }
+  }
+
+  boolean setByteBits(uint8 id, uint8 byte_index, uint8 mask, uint8 value) {
+    return private_::updateByteTransform(id, byte_index, mask, mask, value, 0);
+  }
+
+  boolean invertByteBits(uint8 id, uint8 byte_index, uint8 mask) {
+    return private_::updateByteTransform(id, byte_index, mask, 0, 0, mask);
+  }
+
+  boolean copyByteBits(uint8 id, uint8 byte_index, uint8 mask) {
+    return private_::updateByteTransform(id, byte_index, mask, 0, 0, 0);
+  }
+
+  void setup() {
+    private_::setupFrameLengths();
+
+    // Called before the ISR is enabled so we can initialize both sets.
+    private_::active_rule_set = 0;
+    private_::swap_requested = false;
+    private_::cancel_state = private_::cancel_states::IDLE;
+    private_::shadow_is_stale = false;
+    clearRules();
+    private_::rule_sets[0] = private_::rule_sets[1];
+    private_::shadow_is_modified = false;
+  }
+
+  boolean clearRules() {
+    private_::RuleSet* const rule_set = private_::editableRuleSet();
+    if (!rule_set) {
+      return false;
+    }
+    for (uint8 id = 0; id < private_::kNumFrameIds; id++) {
+      rule_set->rule_index_by_id[id] = private_::kNoRule;
+    }
+    private_::shadow_is_modified = true;
+    return true;
+  }
+
+  void loop() {
+    // Single byte reads are atomic so no need to disable interrupts. The 8 bit
+    // differences are correct as long as this is called at least once per
+    // 256 modified frames.
+    const uint8 valid_count = private_::valid_frames_count;
+    const uint8 invalid_count = private_::invalid_frames_count;
+    private_::total_valid_frames += (uint8)(valid_count - private_::accounted_valid_frames_count);
+    private_::total_invalid_frames += (uint8)(invalid_count - private_::accounted_invalid_frames_count);
+    private_::accounted_valid_frames_count = valid_count;
+    private_::accounted_invalid_frames_count = invalid_count;
+  }
+
+  void frameArrived(const LinFrame& frame) {
+    using namespace private_;
+
+    // Ignore frames with no slave response.
+    const uint8 num_bytes = frame.num_bytes();
+    if (num_bytes < 3) {
+      return;
+    }
+
+    // Frame bytes are id, data bytes and checksum.
+    const uint8 data_bytes = num_bytes - 2;
+    const uint8 id = frame.get_byte(0) & 0x3f;
+    const uint8 entry = frame_data_bytes_by_id[id];
+    if ((entry & kDataBytesFixed) || (entry & kDataBytesMask) == data_bytes) {
+      if (id == pending_length_id) {
+        pending_length_reports = 0;
+      }
+      return;
+    }
+
+    // A known length is changed only after a few consecutive confirmations.
+    if (entry) {
+      if (pending_length_reports && pending_length_id == id && pending_length_data_bytes == data_bytes) {
+        pending_length_reports++;
+      } else {
+        pending_length_id = id;
+        pending_length_data_bytes = data_bytes;
+        pending_length_reports = 1;
+      }
+      if (pending_length_reports < kRequiredLengthReports) {
+        return;
+      }
+      pending_length_reports = 0;
+    }
+
+    // A single byte write, read by the ISR at the next id byte. The eeprom is
+    // updated in the background.
+    frame_data_bytes_by_id[id] = data_bytes;
+    eeprom_writer::write(kEepromFrameLengthsAddr + id, &data_bytes, 1);
+    sio::printf(F("Frame %02x length: %d\n"), id, data_bytes);
+  }
+
+  uint32 originally_valid_frames() {
+    return private_::total_valid_frames;
+  }
+
+  uint32 originally_invalid_frames() {
+    return private_::total_invalid_frames;
+  }
+
+  void cancelCommit() {
+    // If the ISR swaps the sets right after this test, it answers APPLIED.
+    if (!private_::swap_requested
+        || private_::cancel_state != private_::cancel_states::IDLE) {
+      return;
+    }
+    private_::cancel_state = private_::cancel_states::REQUESTED;
+  }
+
+  void commitRules() {
+    // Pick up the answer of a cancel request. A withdrawn commit leaves the
+    // staged changes in the shadow set, newer than the active one. An applied
+    // one leaves the shadow set stale, as after any swap.
+    const uint8 cancel_state = private_::cancel_state;
+    if (cancel_state == private_::cancel_states::REQUESTED) {
+      return;
+    }
+    if (cancel_state != private_::cancel_states::IDLE) {
+      if (cancel_state == private_::cancel_states::WITHDRAWN) {
+        private_::shadow_is_stale = false;
+        private_::shadow_is_modified = true;
+      }
+      private_::cancel_state = private_::cancel_states::IDLE;
+    }
+
+    if (!private_::shadow_is_modified || private_::swap_requested) {
+      return;
+    }
+    private_::shadow_is_modified = false;
+    // After the swap, the shadow set will be the older of the two.
+    private_::shadow_is_stale = true;
+    // Must be last. From here on the ISR may activate the shadow set at any time.
+    private_::swap_requested = true;
+  }
+}  // namepsace custom_injector
 
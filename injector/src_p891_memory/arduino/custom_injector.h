@@ -21,15 +21,50 @@
 // Controls signals injected into linbus framed passed between the master and the
 // slave (set/reset selected data bits and adjust the checksum byte). 
 //
+// The checksum of a modified frame is not simply recomputed. Instead, the injector
+// computes also the checksum of the original frame and proxies the incoming checksum
+// byte with the bits that differ between the two inverted. This way, a valid incoming
+// frame results in a valid modified frame while an incoming frame that was corrupted
+// (e.g. by electrical noise) results in a modified frame with a bad checksum.
+//
+// Injections are defined by a table of rules keyed by the 6 bit frame id. Each rule
+// has a byte transform per data byte: bits to replace with given values, and bits
+// to invert. This allows to override multi bit fields such as counters or enums, in
+// addition to single bits. The ISR selects the rule once, when the id byte arrives,
+// and then resolves each data bit with a couple of mask tests, regardless of the
+// number of rules.
+//
+// Values that depend on the incoming frames (e.g. a rolling counter) are prepared
+// by the main thread, typically from frameArrived(), and committed for the next
+// occurrence of the frame.
+//
 // Like all the other custom_* files, this file should be adapted to the specific application. 
 // The example provided is for a Sport Mode button press injector for 981/Cayman.
 namespace custom_injector {
   
   // Private state of the injector. Do not use from other files.
   namespace private_ {
+    // Number of distinct frame ids (6 bits).
+    static const uint8 kNumFrameIds = 64;
+
+    // Max number of frame ids that can have injection rules at the same time.
+    // Each rule costs 3 * kMaxDataBytes + 2 bytes of RAM in each of the two rule sets.
+    static const uint8 kMaxRules = 4;
+
+    // Marks an entry in rule_index_by_id that has no rule.
+    static const uint8 kNoRule = 0xff;
+
+    // Max number of data bytes in a frame.
+    static const uint8 kMaxDataBytes = 8;
+
+    // Bits of a frame_data_bytes_by_id entry.
+    static const uint8 kDataBytesMask = 0x0f;
+    // Set if the data length of the id is configured and is not modified by
+    // learning.
+    static const uint8 kDataBytesFixed = 0x80;
+
     // Target injection bits for 981CS Sport and PSE buttons
     static const uint8 kTargetedFrameId = 0x8e;
-    static const uint8 kTargetedFrameDataBytes = 8;
     static const uint8 kSportByteIndex = 1;
     static const uint8 kSportBitIndex = 2;
     static const uint8 kPSEByteIndex = 1;
@@ -37,45 +72,206 @@ namespace custom_injector {
     static const uint8 kASSByteIndex = 3;
     static const uint8 kASSBitIndex = 2;
     
-    extern byte sport_inject_action;
-    extern byte PSE_inject_action;
-    extern byte ASS_inject_action;
+    // Injection rule of a single frame id.
+    struct Rule {
+      // The id byte, including the two parity bits, as it appears on the wire. Frames
+      // whose id byte does not match exactly are passed as is.
+      uint8 protected_id;
+      // Index of the first data byte with modified bits. Bytes before it are
+      // passed as is and can be proxied with minimal delay.
+      uint8 first_modified_byte;
+      // Data bits to replace with the respective bits of force_values. Indexed by
+      // data byte index, bit 0 is the LSB.
+      uint8 force_masks[kMaxDataBytes];
+      // Values of the forced bits. Bits not in force_masks are always zero.
+      uint8 force_values[kMaxDataBytes];
+      // Data bits to invert. A bit is never set in both invert_masks and
+      // force_masks.
+      uint8 invert_masks[kMaxDataBytes];
+    };
     
-    // True if the current linbus frame is transformed by the injector. Othrwise, the 
-    // frame is passed as is.
-    extern boolean frame_id_matches;
+    // A complete set of injection rules.
+    struct RuleSet {
+      // Maps a 6 bit frame id to an index in rules[], or kNoRule if the id has
+      // no rule.
+      uint8 rule_index_by_id[kNumFrameIds];
+      // The rules pool. Entries are allocated on demand by the set functions
+      // below.
+      Rule rules[kMaxRules];
+    };
+
+    // Double buffered rule sets. The ISR reads only the active set and the main
+    // thread modifies only the other (shadow) set. The two are swapped by the ISR
+    // at the id byte of a frame, so each frame sees one consistent set.
+    extern RuleSet rule_sets[2];
+
+    // Index [0, 1] of the rule set used by the ISR. Written by the ISR only.
+    extern volatile uint8 active_rule_set;
+
+    // Set by the main thread to request the ISR to swap the rule sets at the next
+    // frame id byte. Cleared by the ISR once swapped. The main thread does not
+    // touch the shadow set while this is set.
+    extern volatile boolean swap_requested;
+
+    // Values of cancel_state. Like enum but 8 bits only.
+    namespace cancel_states {
+      static const uint8 IDLE = 0;
+      // Set by the main thread to have the ISR withdraw swap_requested at the
+      // next frame id byte.
+      static const uint8 REQUESTED = 1;
+      // Set by the ISR in reply. WITHDRAWN if the swap did not happen, APPLIED
+      // if it happened before the request. Set back to IDLE by the main thread.
+      static const uint8 WITHDRAWN = 2;
+      static const uint8 APPLIED = 3;
+    }
+
+    // Handshake of cancelCommit(), a single byte so neither side disables
+    // interrupts. One of cancel_states values.
+    extern volatile uint8 cancel_state;
+
+    // Expected number of data bytes of frames, indexed by the 6 bit id. The low
+    // bits (kDataBytesMask) are the number of data bytes, or zero if unknown. The
+    // injector needs it to tell which byte is the checksum byte, so frames of ids
+    // with unknown length are never modified. Set from configuration and from
+    // learning by frameArrived(), persisted in the eeprom.
+    extern uint8 frame_data_bytes_by_id[kNumFrameIds];
+
+    // The rule of the current linbus frame or NULL if the frame is not transformed
+    // by the injector and is passed as is.
+    extern const Rule* current_rule;
     
-    // Used to calculate the modified frame checksum.
-    extern uint16 sum;
+    // Number of data bytes of the current linbus frame. Valid only if current_rule
+    // is not NULL.
+    extern uint8 frame_data_bytes;
     
-    // The modified frame checksum byte. 
-    extern uint8 checksum;
+    // The ones' complement sum of the modified frame bytes so far.
+    extern uint8 sum;
+
+    // The ones' complement sum of the original frame bytes so far.
+    extern uint8 original_sum;
+
+    // The expected checksum byte of the original frame.
+    extern uint8 original_checksum;
+
+    // The checksum bits that differ between the original and modified frames.
+    // These are the bits that are inverted when proxying the checksum byte.
+    extern uint8 checksum_delta;
+
+    // Number of modified frames with valid and invalid original checksum, modulo
+    // 256. Written by the ISR only. Accumulated by loop().
+    extern volatile uint8 valid_frames_count;
+    extern volatile uint8 invalid_frames_count;
+
+    // Add a byte to a ones' complement sum, folding the carry back immediately.
+    // This keeps the cost per byte constant and the checksum of the frame is
+    // available as soon as the last data byte is added. The end around carry
+    // cannot generate another carry.
+    inline uint8 addWithCarry(uint8 sum, uint8 b) {
+      const uint16 result = (uint16)sum + b;
+      return (uint8)result + (uint8)(result >> 8);
+    }
   }
   
   // ====== These functions should be called from main thread only ================
   
+  // Called once during initialization, before the lin_processor ISR is enabled.
+  extern void setup();
+
+  // Set the transfer function of a single data bit of all the frames with given
+  // id. id is either the 6 bit id or the id byte with the parity bits, byte_index
+  // is 0 for the first data byte, bit_index is 0 for the LSB and action is one of
+  // injector_actions values. Setting the last modified bit of an id to COPY_BIT
+  // releases its rule. Returns false if the id needs a new rule and all the
+  // kMaxRules rules are in use, or if a commit is still pending.
+  //
+  // Changes are staged and take effect only after commitRules().
+  extern boolean setBitAction(uint8 id, uint8 byte_index, uint8 bit_index, uint8 action);
+
+  // Like setBitAction() but for all the bits of a data byte at once. The bits in
+  // mask are replaced with the respective bits of value. Other bits keep their
+  // transfer function.
+  extern boolean setByteBits(uint8 id, uint8 byte_index, uint8 mask, uint8 value);
+
+  // Like setByteBits() but the bits in mask are inverted.
+  extern boolean invertByteBits(uint8 id, uint8 byte_index, uint8 mask);
+
+  // Like setByteBits() but the bits in mask are passed as is.
+  extern boolean copyByteBits(uint8 id, uint8 byte_index, uint8 mask);
+
+  // Replace a multi bit field of a data byte. lsb_index is the index of the
+  // lowest bit of the field and value is the field value, not shifted.
+  inline boolean setFieldValue(uint8 id, uint8 byte_index, uint8 lsb_index, uint8 num_bits,
+      uint8 value) {
+    const uint8 mask = (uint8)(((1 << num_bits) - 1) << lsb_index);
+    return setByteBits(id, byte_index, mask, value << lsb_index);
+  }
+
+  // Release all the rules. All frames are passed as is once committed. Returns
+  // false if a commit is still pending.
+  extern boolean clearRules();
+
+  // Publish the staged rule changes, if any, to the ISR. They are applied
+  // atomically at the id byte of the next frame.
+  extern void commitRules();
+
+  // True if the last commitRules() or cancelCommit() was not handled yet by the
+  // ISR. Rules cannot be changed until it is.
+  inline boolean isCommitPending() {
+    return private_::swap_requested
+        || private_::cancel_state != private_::cancel_states::IDLE;
+  }
+
+  // Ask the ISR to take back the last commitRules() if it did not apply it yet.
+  // The ISR answers at the next frame id byte and commitRules() picks up the
+  // answer. The changes of a withdrawn commit stay staged, can be changed again
+  // and are published by a later commitRules(). Does nothing if no commit is
+  // pending.
+  extern void cancelCommit();
+
+  // Called once on each iteration of the main loop(). Accumulates the frame
+  // counters below.
+  extern void loop();
+
+  // Called once when a new valid frame was recieved. Used to learn the data
+  // length of frame ids that are not configured.
+  extern void frameArrived(const LinFrame& frame);
+
+  // Number of modified frames whose original checksum was valid, since
+  // program start.
+  extern uint32 originally_valid_frames();
+
+  // Number of modified frames whose original checksum was invalid and thus
+  // were proxied with an invalid checksum, since program start.
+  extern uint32 originally_invalid_frames();
+
   inline void disableSportInject(void) {
-    private_::sport_inject_action = injector_actions::COPY_BIT;
+    setBitAction(private_::kTargetedFrameId, private_::kSportByteIndex, private_::kSportBitIndex,
+        injector_actions::COPY_BIT);
   }
 
   inline void disablePSEInject(void) {
-    private_::PSE_inject_action = injector_actions::COPY_BIT;
+    setBitAction(private_::kTargetedFrameId, private_::kPSEByteIndex, private_::kPSEBitIndex,
+        injector_actions::COPY_BIT);
   }
 
   inline void disableASSInject(void) {
-    private_::ASS_inject_action = injector_actions::COPY_BIT;
+    setBitAction(private_::kTargetedFrameId, private_::kASSByteIndex, private_::kASSBitIndex,
+        injector_actions::COPY_BIT);
   }
 
   inline void setSportInject(boolean on) {
-    private_::sport_inject_action = on ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0;
+    setBitAction(private_::kTargetedFrameId, private_::kSportByteIndex, private_::kSportBitIndex,
+        on ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0);
   }
     
   inline void setPSEInject(boolean on) {
-    private_::PSE_inject_action = on ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0;
+    setBitAction(private_::kTargetedFrameId, private_::kPSEByteIndex, private_::kPSEBitIndex,
+        on ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0);
   }
 
   inline void setASSInject(boolean on) {
-    private_::ASS_inject_action = on ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0;
+    setBitAction(private_::kTargetedFrameId, private_::kASSByteIndex, private_::kASSBitIndex,
+        on ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0);
   }  
 
   // ====== These function should be called from lib_processor ISR only =============
@@ -83,53 +279,85 @@ namespace custom_injector {
   // Called when the id byte is recieved.
   // Called from lin_processor's ISR.
   inline void onIsrFrameIdRecieved(uint8 id) {
-    private_::frame_id_matches = false;
-
-    if (id == private_::kTargetedFrameId)
-      {
-      if (private_::sport_inject_action != injector_actions::COPY_BIT)
-         {
-         private_::frame_id_matches = true;
-         }
-      else if (private_::PSE_inject_action != injector_actions::COPY_BIT)
-         {
-         private_::frame_id_matches = true;
-         }
-      else if (private_::ASS_inject_action != injector_actions::COPY_BIT)
-         {
-         private_::frame_id_matches = true;
-         }   
+    private_::current_rule = NULL;
+
+    // Answer a cancel request of the main thread, before the swap.
+    if (private_::cancel_state == private_::cancel_states::REQUESTED) {
+      const boolean is_withdrawn = private_::swap_requested;
+      private_::swap_requested = false;
+      private_::cancel_state = is_withdrawn
+          ? private_::cancel_states::WITHDRAWN : private_::cancel_states::APPLIED;
+    }
+
+    // Latch pending rule changes. This is the only place where the active
+    // rule set changes.
+    if (private_::swap_requested) {
+      private_::active_rule_set ^= 1;
+      private_::swap_requested = false;
+    }
+
+    const private_::RuleSet& rule_set = private_::rule_sets[private_::active_rule_set];
+    const uint8 rule_index = rule_set.rule_index_by_id[id & 0x3f];
+    if (rule_index != private_::kNoRule) {
+      const private_::Rule* const rule = &rule_set.rules[rule_index];
+      // Ignore ids with bad parity bits and ids with unknown data length or
+      // checksum model.
+      const uint8 data_bytes = private_::frame_data_bytes_by_id[id & 0x3f] & private_::kDataBytesMask;
+      if (rule->protected_id == id && data_bytes
+          && checksum_models::modelOf(id) != checksum_models::UNKNOWN) {
+        private_::current_rule = rule;
+        private_::frame_data_bytes = data_bytes;
       }
-    // Linbus checksum V2 includes also the ID byte. 
-    private_::sum = custom_defs::kUseLinChecksumVersion2 ? id : 0;
-    private_::checksum = 0x00;
+    }
+
+    // The enhanced checksum includes also the ID byte.
+    private_::sum = checksum_models::isEnhanced(id) ? id : 0;
+    private_::original_sum = private_::sum;
+    private_::checksum_delta = 0x00;
   }
 
-  // Called when a data or checksum byte is sent (but not the sync or id bytes). 
-  // The injector uses it to compute the modified frame checksum.
+  // Called when the last data bit of a data or checksum byte is sent (but not for
+  // the sync or id bytes), one bit time before the stop bit ends. b is the byte
+  // as sent, including injected bits. original_b is the byte as recieved. The
+  // injector uses them to compute the modified frame checksum and to verify the
+  // original one.
   // Called from lin_processor's ISR.
-  inline void onIsrByteSent(uint8 byte_index, uint8 b) {
+  inline void onIsrByteSent(uint8 byte_index, uint8 b, uint8 original_b) {
     // If this is not a frame we modify then do nothing.
-    if (!private_::frame_id_matches) {
+    if (!private_::current_rule) {
       return;
     }
     
-    // Collect the sum. Used later to compute the checksum byte.
-    private_::sum += b;
-    
-    // If we just recieved the last data byte, compute the modified frame checksum.
-    if (byte_index == (private_::kTargetedFrameDataBytes - 1)) {
-      // Keep adding the high and low bytes until no carry.
-      for (;;) {
-        const uint8 highByte = (uint8)(private_::sum >> 8);
-        if (!highByte) {
-          break;  
-        }
-        // NOTE: this can add additional carry.  
-        private_::sum = (private_::sum & 0xff) + highByte; 
+    // Handle the checksum byte.
+    if (byte_index == private_::frame_data_bytes) {
+      if (original_b == private_::original_checksum) {
+        private_::valid_frames_count++;
+      } else {
+        private_::invalid_frames_count++;
       }
-      private_::checksum = (uint8)(~private_::sum);
+      return;
     }
+    
+    // Collect the sums. Used later to compute the checksum bytes.
+    private_::sum = private_::addWithCarry(private_::sum, b);
+    private_::original_sum = private_::addWithCarry(private_::original_sum, original_b);
+
+    // If we just recieved the last data byte, compute the checksum bits to invert.
+    // The sums are already folded so this takes a constant short time.
+    if (byte_index == (private_::frame_data_bytes - 1)) {
+      private_::original_checksum = ~private_::original_sum;
+      private_::checksum_delta = private_::sum ^ private_::original_sum;
+    }
+  }
+
+  // Called at the start bit of each data or checksum byte. Returns true if the byte
+  // and all the bytes before it in the current frame are not modified by the
+  // injector, in which case lin_processor may proxy it by following the rx edges.
+  // byte_index = 0 for first data byte, 1 for second data byte, ...
+  // Called from lin_processor's ISR.
+  inline boolean onIsrIsByteUnmodified(uint8 byte_index) {
+    const private_::Rule* const rule = private_::current_rule;
+    return !rule || byte_index < rule->first_modified_byte;
   }
 
   // Called before sending a data bit of the the data or checksum bytes to get the 
@@ -138,31 +366,33 @@ namespace custom_injector {
   // bit_index = 0 for LSB, 7 for MSB.
   // Called from lin_processor's ISR.
   inline byte onIsrNextBitAction(uint8 byte_index, uint8 bit_index) {
-    if (!private_::frame_id_matches) {
+    const private_::Rule* const rule = private_::current_rule;
+    if (!rule) {
       return injector_actions::COPY_BIT;
     }
 
+    const uint8 mask = bitMask(bit_index);
+
     // Handle a bit of one of the data bytes.
-    if (byte_index < private_::kTargetedFrameDataBytes) {
-      if ((byte_index == private_::kSportByteIndex) && (bit_index == private_::kSportBitIndex))
-         return private_::sport_inject_action;
-      else if ((byte_index == private_::kPSEByteIndex) && (bit_index == private_::kPSEBitIndex))
-         return private_::PSE_inject_action;
-      else if ((byte_index == private_::kASSByteIndex) && (bit_index == private_::kASSBitIndex))
-         return private_::ASS_inject_action;   
-      else 
-         return injector_actions::COPY_BIT;
+    if (byte_index < private_::frame_data_bytes) {
+      if (rule->force_masks[byte_index] & mask) {
+        return (rule->force_values[byte_index] & mask) ? injector_actions::FORCE_BIT_1
+            : injector_actions::FORCE_BIT_0;
+      }
+      return (rule->invert_masks[byte_index] & mask) ? injector_actions::INVERT_BIT
+          : injector_actions::COPY_BIT;
     }
     
-    // Handle a checksum bit.
-    const boolean checksumBit = private_::checksum & bitMask(bit_index);
-    return checksumBit ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0;
+    // Handle a checksum bit. The incoming checksum bit is proxied, inverted if
+    // the injected bits changed it.
+    if (byte_index == private_::frame_data_bytes) {
+      return (private_::checksum_delta & mask) ? injector_actions::INVERT_BIT : injector_actions::COPY_BIT;
+    }
     
-    // TODO: handle the unexpected case of more than 6 + 1 bytes in the frame. For
-    // now we will repeat the checksum byte blindly.
+    // Unexpected bytes after the checksum byte are passed as is.
+    return injector_actions::COPY_BIT;
   }  
 }  // namepsace custom_injector
 
 #endif
 
-
@@ -19,14 +19,20 @@
 #include "custom_signals.h"
 #include "io_pins.h"
 #include "leds.h"
+#include "passive_timer.h"
+#include "settings.h"
+#include "signal_events.h"
 #include "signal_tracker.h"
 #include "sio.h"
+#include "timer_wheel.h"
 
 // Like all the other custom_* files, this file should be adapted to the specific application. 
 // The example provided is for a Sport/PSE button memory feature for 981 Boxster/Cayman 
 // (probably compatible with 991 models as well)
 namespace custom_module {
 
+// The modes are remembered in the settings store. Before it they were in these
+// eeprom bytes, which are copied to the settings on the first setup().
 // (0 and 1 are the 16-bit word for config enable/disable)
 uint8_t *EEPROM_SPORT_BYTE_ADDR = (uint8_t *) 2;
 uint8_t *EEPROM_PSE_BYTE_ADDR   = (uint8_t *) 3;
@@ -43,19 +49,93 @@ namespace states {
 // The current state. One of states:: values. 
 static uint8 state;
 
-// Tracks since change to current state.
+// Tracks since change to current state. Restarted again once the injection
+// changes made when entering the state were applied by the ISR.
 static PassiveTimer time_in_state;
+
+// True if the state was changed and time_in_state was not restarted yet for the
+// commit of its changes.
+static boolean is_state_commit_pending;
+
+// True when the POLL state should compare the LEDs with the settings. Set by the
+// signal events of the buttons and LEDs, and when entering POLL.
+static boolean is_poll_pending;
+
+// A button is considered down for this time after its release.
+static const uint16 kReleaseLagMillis = 250;
+
+// Started by a button release. The POLL state is evaluated again when the
+// button release lag expires.
+static void onReleaseLagTimer(void* context) {
+  is_poll_pending = true;
+}
+static timer_wheel::Timer release_lag_timer(onReleaseLagTimer, NULL);
   
 static inline void changeToState(uint8 new_state) {
   state = new_state;
   // We assume this is a new state and always reset the time in state.
   time_in_state.restart();
+  is_state_commit_pending = true;
+  if (new_state == states::POLL) {
+    is_poll_pending = true;
+  }
+}
+
+static void onSignalEvent(const signal_events::SignalEvent& event) {
+  using namespace custom_signals::signal_ids;
+  switch (event.signal_id) {
+    case SPORT_SWITCH:
+    case PSE_SWITCH:
+    case AUTOSTART_SWITCH:
+      if (event.old_state == SignalTracker::States::ON) {
+        release_lag_timer.start(kReleaseLagMillis);
+      }
+      is_poll_pending = true;
+      break;
+
+    case SPORT_LED:
+    case SPORT_PLUS_LED:
+    case PSE_LED:
+    case AUTOSTART_LED:
+      is_poll_pending = true;
+      break;
+  }
+}
+
+// Copy a mode from its legacy eeprom byte to the settings, unless already there.
+static void migrateLegacyMode(uint8 key, const uint8_t* legacy_addr) {
+  if (!settings::has(key)) {
+    settings::set(key, eeprom_read_byte(legacy_addr) != 0);
+  }
 }
 
+// Print the injector frame counters if they changed. Called by
+// report_timer every few seconds.
+static void reportInjectedFrames(void* context) {
+  static uint32 reported_valid_frames = 0;
+  static uint32 reported_invalid_frames = 0;
+
+  const uint32 valid_frames = custom_injector::originally_valid_frames();
+  const uint32 invalid_frames = custom_injector::originally_invalid_frames();
+  if (valid_frames == reported_valid_frames && invalid_frames == reported_invalid_frames) {
+    return;
+  }
+  sio::printf(F("Injected frames: %lu ok, %lu bad\n"), valid_frames, invalid_frames);
+  reported_valid_frames = valid_frames;
+  reported_invalid_frames = invalid_frames;
+}
+static timer_wheel::Timer report_timer(reportInjectedFrames, NULL);
+
 void setup() {
+  migrateLegacyMode(settings::keys::SPORT_MODE, EEPROM_SPORT_BYTE_ADDR);
+  migrateLegacyMode(settings::keys::PSE_MODE, EEPROM_PSE_BYTE_ADDR);
+  migrateLegacyMode(settings::keys::ASS_MODE, EEPROM_ASS_BYTE_ADDR);
+  custom_injector::setup();
   custom_signals::setup();
   custom_config::setup();
   changeToState(states::WAIT_IGNITION);
+  signal_events::subscribe(onSignalEvent);
+  report_timer.startPeriodic(5000);
 }
   
 static inline void updateState() 
@@ -76,12 +156,37 @@ static inline void updateState()
    //   been off for less than 250 milliseconds.  This lag keeps us from reverting quick button presses that
    //   are released by the user before we see the corresponding event on the LIN bus
    //
+   // - Injection changes are staged and committed by loop(). Wait until the previous commit is
+   //   applied by the ISR so each frame sees a consistent set of injected bits. Ignition off is
+   //   handled before that. It cancels a commit that is still pending and the WAIT_IGNITION
+   //   state releases the injects once the ISR answered.
+   //
+   // - The 500 ms of the INJECT_* states count from when their commit is applied.
+   //
+   // - The POLL state is evaluated only on signal events of the buttons and LEDs, when entering
+   //   it and when the button release lag expires, rather than on every loop.
+   //
 
-   if (custom_signals::ignition_state().isOff())
+   if (custom_signals::ignition_state().isOff() && state != states::WAIT_IGNITION)
       {
+      custom_injector::cancelCommit();
+      custom_injector::disableSportInject();
+      custom_injector::disablePSEInject();
+      custom_injector::disableASSInject();
       changeToState(states::WAIT_IGNITION);
       }
 
+   if (custom_injector::isCommitPending())
+      {
+      return;
+      }
+
+   if (is_state_commit_pending)
+      {
+      is_state_commit_pending = false;
+      time_in_state.restart();
+      }
+
    switch (state)
       {
       case states::WAIT_IGNITION:
@@ -100,16 +205,22 @@ static inline void updateState()
 
       case states::POLL:
          {
+         if (!is_poll_pending)
+            {
+            break;
+            }
+         is_poll_pending = false;
+
          boolean sport_plus_active = custom_signals::sport_plus_LED().isOn();
-         boolean sport_remembered  = eeprom_read_byte(EEPROM_SPORT_BYTE_ADDR);
+         boolean sport_remembered  = settings::get(settings::keys::SPORT_MODE, 0);
          boolean sport_active      = custom_signals::sport_LED().isOn();
-         boolean sport_button_down = custom_signals::sport_switch().isOn() || (custom_signals::sport_switch().timeInStateMillis() < 250);
+         boolean sport_button_down = custom_signals::sport_switch().isOn() || (custom_signals::sport_switch().timeInStateMillis() < kReleaseLagMillis);
 
          if (sport_active != sport_remembered)
             {
             if (sport_button_down)
                {
-               eeprom_write_byte(EEPROM_SPORT_BYTE_ADDR, sport_active);
+               settings::set(settings::keys::SPORT_MODE, sport_active);
                }
             else
                {
@@ -123,15 +234,15 @@ static inline void updateState()
                }
             }
 
-         boolean PSE_remembered  = eeprom_read_byte(EEPROM_PSE_BYTE_ADDR);
+         boolean PSE_remembered  = settings::get(settings::keys::PSE_MODE, 0);
          boolean PSE_active      = custom_signals::PSE_LED().isOn();
-         boolean PSE_button_down = custom_signals::PSE_switch().isOn() || (custom_signals::PSE_switch().timeInStateMillis() < 250); 
+         boolean PSE_button_down = custom_signals::PSE_switch().isOn() || (custom_signals::PSE_switch().timeInStateMillis() < kReleaseLagMillis); 
 
          if (PSE_active != PSE_remembered)
             {
             if (PSE_button_down)
                {
-               eeprom_write_byte(EEPROM_PSE_BYTE_ADDR, PSE_active);
+               settings::set(settings::keys::PSE_MODE, PSE_active);
                }
             else
                {
@@ -142,15 +253,15 @@ static inline void updateState()
                }
             }
 
-         boolean ASS_remembered  = eeprom_read_byte(EEPROM_ASS_BYTE_ADDR);
+         boolean ASS_remembered  = settings::get(settings::keys::ASS_MODE, 0);
          boolean ASS_active      = custom_signals::autostart_LED().isOn();
-         boolean ASS_button_down = custom_signals::autostart_switch().isOn() || (custom_signals::autostart_switch().timeInStateMillis() < 250); 
+         boolean ASS_button_down = custom_signals::autostart_switch().isOn() || (custom_signals::autostart_switch().timeInStateMillis() < kReleaseLagMillis); 
 
          if (ASS_active != ASS_remembered)
             {
             if (ASS_button_down)
                {
-               eeprom_write_byte(EEPROM_ASS_BYTE_ADDR, ASS_active);
+               settings::set(settings::keys::ASS_MODE, ASS_active);
                }
             else
                {
@@ -238,12 +349,17 @@ static inline void showPanelState()
 
 void loop() {
   // Update dependents.
+  custom_injector::loop();
   custom_signals::loop();
   custom_config::loop();
   
 #if 1
    // Update the state machine
    updateState();
+
+   // Publish injection changes made by the state machine, if any. Applied by
+   // the ISR at the next frame id byte.
+   custom_injector::commitRules();
 #else
    // Diagnostic mode: print button and LED states
    showPanelState();
@@ -253,6 +369,9 @@ void loop() {
 }
 
 void frameArrived(const LinFrame& frame) {
+  // Learn the length of the frame.
+  custom_injector::frameArrived(frame);
+
   // Track the signals in this frame.
   custom_signals::frameArrived(frame);
   
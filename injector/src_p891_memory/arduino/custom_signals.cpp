@@ -12,6 +12,8 @@
 
 #include "custom_signals.h"
 
+#include "signal_events.h"
+#include "signal_table.h"
 #include "signal_tracker.h"
 
 // Like all the other custom_* files, this file should be adapted to the specific application. 
@@ -20,66 +22,102 @@ namespace custom_signals {
 
 // Variables used in .h file.
 namespace private_ {
-  SignalTracker ignition_on_signal_tracker(3, 1000, 2000);
+  // Tracker configs.
+  static const SignalTrackerConfig kIgnitionConfig PROGMEM = { 3, 1000, 2000 };
   // NOTE: we require only a single button report to change state. This prevents
   // missing clicks when clicking fast.
-  SignalTracker button_signal_tracker(1, 1000, 2000);
+  static const SignalTrackerConfig kButtonConfig PROGMEM = { 1, 1000, 2000 };
+
+  SignalTracker ignition_on_signal_tracker(&kIgnitionConfig);
+  SignalTracker button_signal_tracker(&kButtonConfig);
 
   //
   // 981 buttons and LEDs
   //
 
-  SignalTracker autostart_switch    (1, 1000, 2000); 
-  SignalTracker autostart_LED       (1, 1000, 2000); 
+  SignalTracker autostart_switch    (&kButtonConfig);
+  SignalTracker autostart_LED       (&kButtonConfig);
                                     
-  SignalTracker PASM_switch         (1, 1000, 2000); 
-  SignalTracker PASM_LED            (1, 1000, 2000); 
+  SignalTracker PASM_switch         (&kButtonConfig);
+  SignalTracker PASM_LED            (&kButtonConfig);
                                     
-  SignalTracker PSE_switch          (1, 1000, 2000);
-  SignalTracker PSE_LED             (1, 1000, 2000);
+  SignalTracker PSE_switch          (&kButtonConfig);
+  SignalTracker PSE_LED             (&kButtonConfig);
                                     
-  SignalTracker PSM_switch          (1, 1000, 2000); 
-  SignalTracker PSM_LED             (1, 1000, 2000); 
+  SignalTracker PSM_switch          (&kButtonConfig);
+  SignalTracker PSM_LED             (&kButtonConfig);
 
-  SignalTracker roof_close_switch   (1, 1000, 2000); 
-  SignalTracker roof_open_switch    (1, 1000, 2000); 
+  SignalTracker roof_close_switch   (&kButtonConfig);
+  SignalTracker roof_open_switch    (&kButtonConfig);
 
-  SignalTracker spoiler_switch      (1, 1000, 2000); 
-  SignalTracker spoiler_LED         (1, 1000, 2000); 
+  SignalTracker spoiler_switch      (&kButtonConfig);
+  SignalTracker spoiler_LED         (&kButtonConfig);
                                     
-  SignalTracker sport_switch        (1, 1000, 2000);
-  SignalTracker sport_LED           (1, 1000, 2000);
+  SignalTracker sport_switch        (&kButtonConfig);
+  SignalTracker sport_LED           (&kButtonConfig);
                                     
-  SignalTracker sport_plus_switch   (1, 1000, 2000); 
-  SignalTracker sport_plus_LED      (1, 1000, 2000); 
+  SignalTracker sport_plus_switch   (&kButtonConfig);
+  SignalTracker sport_plus_LED      (&kButtonConfig);
+
+  using signal_table::SignalDescriptor;
+  using signal_table::FrameDescriptor;
+  using signal_table::FrameCache;
+
+  FrameCache switches_frame_cache;
+  FrameCache leds_frame_cache;
+
+  // Slave-to-master frame (physical switches).
+  static const SignalDescriptor kSwitchesFrameSignals[] PROGMEM = {
+    // signal id, byte, lsb, bits, on value, tracker
+    { signal_ids::CONFIG_BUTTON, 1, 2, 1, 1, &button_signal_tracker },
+    { signal_ids::AUTOSTART_SWITCH, 3, 2, 1, 1, &autostart_switch },
+    { signal_ids::PASM_SWITCH, 0, 3, 1, 1, &PASM_switch },
+    { signal_ids::PSE_SWITCH, 1, 7, 1, 1, &PSE_switch },
+    { signal_ids::PSM_SWITCH, 2, 0, 1, 1, &PSM_switch },
+    { signal_ids::ROOF_CLOSE_SWITCH, 2, 7, 1, 1, &roof_close_switch },
+    { signal_ids::ROOF_OPEN_SWITCH, 2, 6, 1, 1, &roof_open_switch },
+    { signal_ids::SPOILER_SWITCH, 1, 3, 1, 1, &spoiler_switch },
+    { signal_ids::SPORT_SWITCH, 1, 2, 1, 1, &sport_switch },
+    { signal_ids::SPORT_PLUS_SWITCH, 1, 4, 1, 1, &sport_plus_switch },
+  };
+
+  // Master-to-slave frame (ignition state, button LEDs...)
+  static const SignalDescriptor kLedsFrameSignals[] PROGMEM = {
+    // signal id, byte, lsb, bits, on value, tracker
+    { signal_ids::IGNITION, 5, 7, 1, 1, &ignition_on_signal_tracker },
+    { signal_ids::AUTOSTART_LED, 3, 4, 1, 1, &autostart_LED },
+    // (both bits 4 and 5 observed on 2013 981BS USA model, neither are turned on by Sport Plus button...?)
+    { signal_ids::PASM_LED, 0, 4, 1, 1, &PASM_LED },
+    { signal_ids::PSE_LED, 2, 6, 1, 1, &PSE_LED },
+    // (both bits 2 and 7 observed on 2013 981BS USA model)
+    { signal_ids::PSM_LED, 3, 2, 1, 1, &PSM_LED },
+    { signal_ids::SPOILER_LED, 2, 3, 1, 1, &spoiler_LED },
+    { signal_ids::SPORT_LED, 3, 0, 1, 1, &sport_LED },
+    { signal_ids::SPORT_PLUS_LED, 3, 5, 1, 1, &sport_plus_LED },
+  };
+
+  // The signal database. To track a new signal, add a signal id, a tracker
+  // above and a line to the table of its frame.
+  static const FrameDescriptor kFrames[] PROGMEM = {
+    // id (with parity bits), data bytes, signals, cache
+    { 0x8e, 8, kSwitchesFrameSignals, ARRAY_SIZE(kSwitchesFrameSignals), &switches_frame_cache },
+    { 0x0d, 8, kLedsFrameSignals, ARRAY_SIZE(kLedsFrameSignals), &leds_frame_cache },
+  };
 }
 
 void setup() {
-  // Nothing to do here.
+  signal_events::setup();
+  private_::switches_frame_cache.is_valid = false;
+  private_::leds_frame_cache.is_valid = false;
 }
   
 // Called repeatidly from the main loop().
 void loop() {
   // Loop dependents.
-  private_::ignition_on_signal_tracker.loop();
-  private_::button_signal_tracker.loop();
-
-  private_::autostart_switch.loop();
-  private_::autostart_LED.loop();
-  private_::PASM_switch.loop();
-  private_::PASM_LED.loop();
-  private_::PSE_switch.loop();
-  private_::PSE_LED.loop();
-  private_::PSM_switch.loop();
-  private_::PSM_LED.loop();
-  private_::roof_close_switch.loop();
-  private_::roof_open_switch.loop();
-  private_::spoiler_switch.loop();
-  private_::spoiler_LED.loop();
-  private_::sport_switch.loop();
-  private_::sport_LED.loop();
-  private_::sport_plus_switch.loop();
-  private_::sport_plus_LED.loop();
+  signal_table::loop(private_::kFrames, ARRAY_SIZE(private_::kFrames));
+
+  // Pass the signal changes of this loop to the subscribed modules.
+  signal_events::dispatch();
 }
 
 // Handling of frame from sport mode button unit.
@@ -89,44 +127,11 @@ void frameArrived(const LinFrame& frame) {
     return;
   }
 
-  // Get frame id.
-  const uint8 id = frame.get_byte(0);
-  
-  // Handle slave-to-master frames (physical switches)
-  if (id == 0x8e) {
-    if (frame.num_bytes() == (1 + 8 + 1)) {
-      const boolean button_is_pressed = frame.get_byte(2) & H(2);
-      private_::button_signal_tracker.reportSignal(button_is_pressed);
-
-      private_::autostart_switch.reportSignal   (frame.get_byte(4) & H(2));
-      private_::PASM_switch.reportSignal        (frame.get_byte(1) & H(3));
-      private_::PSE_switch.reportSignal         (frame.get_byte(2) & H(7));
-      private_::PSM_switch.reportSignal         (frame.get_byte(3) & H(0));
-      private_::roof_close_switch.reportSignal  (frame.get_byte(3) & H(7));
-      private_::roof_open_switch.reportSignal   (frame.get_byte(3) & H(6));
-      private_::spoiler_switch.reportSignal     (frame.get_byte(2) & H(3));
-      private_::sport_switch.reportSignal       (frame.get_byte(2) & H(2));
-      private_::sport_plus_switch.reportSignal  (frame.get_byte(2) & H(4));
-    }
-    return;
-  }
+  signal_table::frameArrived(private_::kFrames, ARRAY_SIZE(private_::kFrames), frame);
 
-  // Handle master-to-slave frames (ignition state, button LEDs...)
-  if (id == 0x0d) {
-    if (frame.num_bytes() == (1 + 8 + 1)) {
-      const boolean is_ignition_bit_on = frame.get_byte(6) & H(7);
-      private_::ignition_on_signal_tracker.reportSignal(is_ignition_bit_on);
-
-      private_::autostart_LED.reportSignal      (frame.get_byte(4) & H(4));
-      private_::PASM_LED.reportSignal           (frame.get_byte(1) & H(4));   // (both H(4) and H(5) observed on 2013 981BS USA model, neither are turned on by Sport Plus button...?)
-      private_::PSE_LED.reportSignal            (frame.get_byte(3) & H(6));
-      private_::PSM_LED.reportSignal            (frame.get_byte(4) & H(2));   // (both H(2) and H(7) observed on 2013 981BS USA model)
-      private_::spoiler_LED.reportSignal        (frame.get_byte(3) & H(3));
-      private_::sport_LED.reportSignal          (frame.get_byte(4) & H(0));
-      private_::sport_plus_LED.reportSignal     (frame.get_byte(4) & H(5));
-    }
-    return;
-  }
+  // Several frames may arrive between two loops. Pass the signal changes of
+  // each as it arrives so they do not add up in the queue.
+  signal_events::dispatch();
 }
 
 }  // namespace custom_signals
@@ -22,6 +22,28 @@
 // Like all the other custom_* files, this file should be adapted to the specific application. 
 // The example provided is for a Sport Mode button press injector for 981/Cayman.
 namespace custom_signals {
+  // Ids of the signals in the signal events. Like enum but 8 bits only.
+  namespace signal_ids {
+    static const uint8 IGNITION = 0;
+    static const uint8 CONFIG_BUTTON = 1;
+    static const uint8 AUTOSTART_SWITCH = 2;
+    static const uint8 AUTOSTART_LED = 3;
+    static const uint8 PASM_SWITCH = 4;
+    static const uint8 PASM_LED = 5;
+    static const uint8 PSE_SWITCH = 6;
+    static const uint8 PSE_LED = 7;
+    static const uint8 PSM_SWITCH = 8;
+    static const uint8 PSM_LED = 9;
+    static const uint8 ROOF_CLOSE_SWITCH = 10;
+    static const uint8 ROOF_OPEN_SWITCH = 11;
+    static const uint8 SPOILER_SWITCH = 12;
+    static const uint8 SPOILER_LED = 13;
+    static const uint8 SPORT_SWITCH = 14;
+    static const uint8 SPORT_LED = 15;
+    static const uint8 SPORT_PLUS_SWITCH = 16;
+    static const uint8 SPORT_PLUS_LED = 17;
+  }
+
   namespace private_ {
     // Tracks the ingition-on status.
     extern SignalTracker ignition_on_signal_tracker;
@@ -62,7 +84,8 @@ namespace custom_signals {
   // Called once during initialization.
   extern void setup();
 
-  // Called once on each iteration of the Arduino main loop().
+  // Called once on each iteration of the Arduino main loop(). Dispatches the
+  // signal events.
   extern void loop();
 
   // Called once when a new valid frame was recieved. Used to intercept
@@ -0,0 +1,124 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "eeprom_writer.h"
+
+#include <avr/eeprom.h>
+
+#include "sio.h"
+
+namespace eeprom_writer {
+
+  namespace private_ {
+    QueuedByte queue[kQueueSize];
+    uint8 queue_head;
+    uint8 queue_count;
+
+    // True if the write of the byte at the queue head was started and is not
+    // verified yet.
+    static boolean is_writing;
+
+    static uint8 error_flags;
+
+    static inline void popHead() {
+      queue_head = (queue_head + 1) % kQueueSize;
+      queue_count--;
+    }
+  }
+
+  void setup() {
+    private_::queue_head = 0;
+    private_::queue_count = 0;
+    private_::is_writing = false;
+    private_::error_flags = 0;
+  }
+
+  boolean write(uint8* addr, const void* bytes, uint8 n) {
+    using namespace private_;
+
+    if (n > kQueueSize - queue_count) {
+      error_flags |= errors::OVERRUN;
+      return false;
+    }
+    for (uint8 i = 0; i < n; i++) {
+      QueuedByte& queued_byte = queue[(queue_head + queue_count) % kQueueSize];
+      queued_byte.addr = addr + i;
+      queued_byte.value = ((const uint8*)bytes)[i];
+      queue_count++;
+    }
+    return true;
+  }
+
+  void loop() {
+    using namespace private_;
+
+    // The eeprom functions below do not block when the eeprom is ready.
+    if (!queue_count || !eeprom_is_ready()) {
+      return;
+    }
+
+    const QueuedByte& queued_byte = queue[queue_head];
+    uint8* const addr = queued_byte.addr;
+    const boolean has_value = (eeprom_read_byte(addr) == queued_byte.value);
+
+    // Verify the completed write.
+    if (is_writing) {
+      is_writing = false;
+      if (!has_value) {
+        error_flags |= errors::VERIFY;
+      }
+      popHead();
+      return;
+    }
+
+    // Start the write. It is verified by a later call, when the eeprom is ready
+    // again.
+    if (has_value) {
+      popHead();
+      return;
+    }
+    eeprom_write_byte(addr, queued_byte.value);
+    is_writing = true;
+  }
+
+  uint8 getAndClearErrorFlags() {
+    const uint8 result = private_::error_flags;
+    private_::error_flags = 0;
+    return result;
+  }
+
+  struct BitName {
+    const uint8 mask;
+    const char* const name;
+  };
+
+  static const BitName kErrorBitNames[] PROGMEM = {
+    { errors::VERIFY, "VRFY" },
+    { errors::OVERRUN, "OVRN" },
+  };
+
+  void printErrorFlags(uint8 eeprom_errors) {
+    const uint8 n = ARRAY_SIZE(kErrorBitNames);
+    boolean any_printed = false;
+    for (uint8 i = 0; i < n; i++) {
+      const uint8 mask = pgm_read_byte(&kErrorBitNames[i].mask);
+      if (eeprom_errors & mask) {
+        if (any_printed) {
+          sio::printchar(' ');
+        }
+        const char* const name = (const char*)pgm_read_word(&kErrorBitNames[i].name);
+        sio::print(name);
+        any_printed = true;
+      }
+    }
+  }
+}  // namespace eeprom_writer
@@ -0,0 +1,82 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef EEPROM_WRITER_H
+#define EEPROM_WRITER_H
+
+#include "avr_util.h"
+
+// Non blocking eeprom writes. write() queues the bytes and loop() advances the
+// queue one byte at a time, starting the write of the next byte only when the
+// eeprom is ready, so the main loop is never stalled by the ~3.4ms byte write
+// time. Bytes that already have the queued value are not written. Each written
+// byte is read back and verified when its write completes.
+//
+// Polled from the main loop rather than using the EE_READY interrupt, to keep
+// the timer ISR of the lin processor free of jitter.
+//
+// Reading an address with a queued write returns the old value until the write
+// is completed. Main thread only.
+namespace eeprom_writer {
+  // Max number of queued bytes.
+  static const uint8 kQueueSize = 32;
+
+  // Error flags. Like enum but 8 bits only.
+  namespace errors {
+    // A written byte read back with a different value.
+    static const uint8 VERIFY = (1 << 0);
+    // A write() with not enough room in the queue. Its bytes were not written.
+    static const uint8 OVERRUN = (1 << 1);
+  }
+
+  // Private state. Do not use from other files.
+  namespace private_ {
+    struct QueuedByte {
+      uint8* addr;
+      uint8 value;
+    };
+
+    // A ring of the queued bytes.
+    extern QueuedByte queue[kQueueSize];
+    extern uint8 queue_head;
+    extern uint8 queue_count;
+  }
+
+  // Called once from setup().
+  extern void setup();
+
+  // Queue a write of n bytes starting at the given eeprom address. Either all the
+  // bytes are queued or, if the queue does not have room for them, none is and
+  // false is returned.
+  extern boolean write(uint8* addr, const void* bytes, uint8 n);
+
+  // Number of queued bytes whose write is not completed and verified yet.
+  inline uint8 pendingBytes() {
+    return private_::queue_count;
+  }
+
+  // True if all the queued writes were completed.
+  inline boolean isIdle() {
+    return !private_::queue_count;
+  }
+
+  // Called from the main loop(). Takes a short constant time.
+  extern void loop();
+
+  // Get the error flags and clear them.
+  extern uint8 getAndClearErrorFlags();
+
+  // Print the names of the error flags in the given value.
+  extern void printErrorFlags(uint8 eeprom_errors);
+}  // namespace eeprom_writer
+
+#endif
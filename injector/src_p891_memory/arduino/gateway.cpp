@@ -0,0 +1,112 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gateway.h"
+
+#include "lin_processor.h"
+
+namespace gateway {
+
+  // Private state of the gateway. Do not use from other files.
+  namespace private_ {
+
+    // Initialized by setup().
+    uint8 policy_by_id[kNumFrameIds];
+    Substitute substitutes[kMaxSubstitutes];
+
+    uint8 current_policy;
+
+    // Set the policy_by_id entry of the given 6 bit id and release its substitute
+    // entry, if any.
+    static void setEntry(uint8 id6, uint8 entry) {
+      const uint8 old_entry = policy_by_id[id6];
+      // Single byte write, the ISR sees either the old or the new entry.
+      policy_by_id[id6] = entry;
+      if ((old_entry & kPolicyMask) == policies::SUBSTITUTE && entry != old_entry) {
+        // If the ISR already selected the old entry it will find it empty and
+        // will not answer this frame.
+        substitutes[old_entry >> kSubstituteIndexShift].num_bytes = 0;
+      }
+    }
+  }
+
+  void setup() {
+    for (uint8 id = 0; id < private_::kNumFrameIds; id++) {
+      private_::policy_by_id[id] = policies::PASS;
+    }
+    for (uint8 i = 0; i < private_::kMaxSubstitutes; i++) {
+      private_::substitutes[i].num_bytes = 0;
+    }
+    private_::current_policy = policies::PASS;
+  }
+
+  boolean setPolicy(uint8 id, uint8 policy) {
+    if (policy != policies::PASS && policy != policies::BLOCK_HEADER
+        && policy != policies::BLOCK_RESPONSE) {
+      return false;
+    }
+    private_::setEntry(id & 0x3f, policy);
+    return true;
+  }
+
+  boolean setSubstitute(uint8 id, const uint8* data, uint8 num_data_bytes) {
+    using namespace private_;
+
+    if (num_data_bytes < 1 || num_data_bytes > LinFrame::kMaxBytes - 2) {
+      return false;
+    }
+
+    // Use the substitute entry of this id, or a free one.
+    const uint8 id6 = id & 0x3f;
+    const uint8 old_entry = policy_by_id[id6];
+    uint8 index;
+    if ((old_entry & kPolicyMask) == policies::SUBSTITUTE) {
+      index = old_entry >> kSubstituteIndexShift;
+    } else {
+      for (index = 0; index < kMaxSubstitutes; index++) {
+        if (!substitutes[index].num_bytes) {
+          break;
+        }
+      }
+      if (index >= kMaxSubstitutes) {
+        return false;
+      }
+    }
+
+    // Compute the checksum once here, using the same code that verifies the
+    // recieved frames.
+    LinFrame frame;
+    frame.append_byte(LinFrame::setLinIdChecksumBits(id6), false);
+    for (uint8 i = 0; i < num_data_bytes; i++) {
+      frame.append_byte(data[i], false);
+    }
+    // A place holder for the checksum byte.
+    frame.append_byte(0, false);
+    const uint8 checksum = frame.computeChecksum();
+
+    // The ISR copies the entry at the id byte. Disabling interrupts makes sure it
+    // never sees a partial update. Done right after a tick so the copy does not
+    // delay the next one.
+    Substitute* const substitute = &substitutes[index];
+    lin_processor::waitForIsrEnd();
+    cli();
+    for (uint8 i = 0; i < num_data_bytes; i++) {
+      substitute->bytes[i] = data[i];
+    }
+    substitute->bytes[num_data_bytes] = checksum;
+    substitute->num_bytes = num_data_bytes + 1;
+    sei();
+
+    policy_by_id[id6] = policies::SUBSTITUTE | (index << kSubstituteIndexShift);
+    return true;
+  }
+}  // namespace gateway
@@ -0,0 +1,140 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+
+// Per frame id gateway policies. By default the injector proxies all the frames
+// between the master and the slave. A policy can instead block the header from
+// the slave, block the response from the master, or have the injector answer the
+// master with its own data while the slave is kept out of the frame.
+//
+// The header is blocked by corrupting the stop bit of the id byte on the slave
+// side, which the slave treats as a framing error. Blocked bytes are proxied as
+// recessive bits so the other side sees an idle bus. The frame buffers still get
+// the bytes as recieved.
+//
+// The policy of the current frame is selected with a single table lookup when
+// the id byte arrives, before its stop bit is proxied.
+namespace gateway {
+
+  // A 8 bit enum with the gateway policies of a frame id.
+  namespace policies {
+    // Proxy the frame in both directions (default).
+    static const uint8 PASS = 0;
+
+    // The slave never sees the header. Master published data is not proxied to
+    // the slave either.
+    static const uint8 BLOCK_HEADER = 1;
+
+    // The master never sees the slave response.
+    static const uint8 BLOCK_RESPONSE = 2;
+
+    // Like BLOCK_HEADER but the injector sends the response to the master. For
+    // frames whose response is published by the slave.
+    static const uint8 SUBSTITUTE = 3;
+  }
+
+  // Private state of the gateway. Do not use from other files.
+  namespace private_ {
+    // Number of distinct frame ids (6 bits).
+    static const uint8 kNumFrameIds = 64;
+
+    // Max number of ids with a SUBSTITUTE policy at the same time.
+    static const uint8 kMaxSubstitutes = 2;
+
+    // Bits of a policy_by_id entry.
+    static const uint8 kPolicyMask = 0x03;
+    static const uint8 kSubstituteIndexShift = 2;
+
+    // A substitute response.
+    struct Substitute {
+      // Number of data and checksum bytes. Zero if this entry is not in use.
+      uint8 num_bytes;
+      // The data bytes followed by the checksum byte.
+      uint8 bytes[LinFrame::kMaxBytes - 1];
+    };
+
+    // Policy of each frame id, indexed by the 6 bit id. The low bits (kPolicyMask)
+    // are one of policies values and for SUBSTITUTE, the high bits are the index
+    // of the entry in substitutes[]. Single byte writes by the main thread, so
+    // atomic.
+    extern uint8 policy_by_id[kNumFrameIds];
+
+    // Written by main with interrupts disabled. Read by ISR.
+    extern Substitute substitutes[kMaxSubstitutes];
+
+    // The policy_by_id entry of the current frame. ISR only.
+    extern uint8 current_policy;
+  }
+
+  // ====== These functions should be called from main thread only ================
+
+  // Called once during initialization, before the lin_processor ISR is enabled.
+  extern void setup();
+
+  // Set the policy of the given frame id to PASS, BLOCK_HEADER or BLOCK_RESPONSE.
+  // id is either the 6 bit id or the id byte with the parity bits. Returns false
+  // if policy is not one of these.
+  extern boolean setPolicy(uint8 id, uint8 policy);
+
+  // Set the policy of the given frame id to SUBSTITUTE with the given response
+  // data. num_data_bytes is 1 to 8 and the checksum is computed here. Can be
+  // called again, e.g. from frameArrived() of a custom module, to update the data
+  // with synthesized values or with data cached from earlier frames. Returns false
+  // if the arguments are out of range or if all the kMaxSubstitutes entries are in
+  // use.
+  extern boolean setSubstitute(uint8 id, const uint8* data, uint8 num_data_bytes);
+
+  // ====== These function should be called from lib_processor ISR only =============
+
+  // Called when the last data bit of the id byte is recieved, before its stop
+  // bit is proxied. Selects the policy of the frame.
+  inline void onIsrFrameIdRecieved(uint8 id) {
+    private_::current_policy = private_::policy_by_id[id & 0x3f];
+  }
+
+  // True if the header of the current frame should be blocked from the slave.
+  inline boolean onIsrIsHeaderBlocked() {
+    const uint8 policy = private_::current_policy & private_::kPolicyMask;
+    return policy == policies::BLOCK_HEADER || policy == policies::SUBSTITUTE;
+  }
+
+  // True if the response of the current frame should be blocked. from_master
+  // tells the side that sends the response.
+  inline boolean onIsrIsResponseBlocked(boolean from_master) {
+    return from_master ? onIsrIsHeaderBlocked()
+        : (private_::current_policy & private_::kPolicyMask) != policies::PASS;
+  }
+
+  // If the current frame should be answered by the injector, copy the response
+  // bytes to buffer and return their count. Otherwise return zero. buffer should
+  // have room for LinFrame::kMaxBytes - 1 bytes.
+  inline uint8 onIsrCopySubstitute(uint8* buffer) {
+    const uint8 entry = private_::current_policy;
+    if ((entry & private_::kPolicyMask) != policies::SUBSTITUTE) {
+      return 0;
+    }
+    const private_::Substitute& substitute =
+        private_::substitutes[entry >> private_::kSubstituteIndexShift];
+    const uint8 n = substitute.num_bytes;
+    for (uint8 i = 0; i < n; i++) {
+      buffer[i] = substitute.bytes[i];
+    }
+    return n;
+  }
+}  // namespace gateway
+
+#endif
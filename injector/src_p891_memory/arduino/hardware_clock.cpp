@@ -13,10 +13,15 @@
 #include "hardware_clock.h"
 
 #include <arduino.h>
+#include <avr/interrupt.h>
 #include "avr_util.h"
 
 namespace hardware_clock {
 
+namespace private_ {
+  volatile uint16 overflow_count;
+}
+
 #if F_CPU != 16000000
 #error "The existing code assumes 16Mhz CPU clk."
 #endif
@@ -25,7 +30,7 @@ void setup() {
     // Normal mode (free running [0, ffff]).
     TCCR1A = L(COM1A1) | L(COM1A0) | L(COM1B1) | L(COM1B0) | L(WGM11) | L(WGM10);
     // Prescaler: X64 (250 clocks per ms @ 16MHz). 2^16 clock cycle every ~260ms.
-    // This also defines the max update() interval to avoid missing a counter overflow. 
+    // The overflows are counted by the ISR below.
     TCCR1B = L(ICNC1) | L(ICES1) | L(WGM13) | L(WGM12) | L(CS12) | H(CS11) | H(CS10);
     // Clear counter.
     TCNT1 = 0;
@@ -33,9 +38,18 @@ void setup() {
     OCR1A = 0;
     // Compare B. Used to output cycle pulses, for debugging.
     OCR1B = 0;
-    // Diabled interrupts.
-    TIMSK1 = L(ICIE1) | L(OCIE1B) | L(OCIE1A) | L(TOIE1);
-    TIFR1 = L(ICF1) | L(OCF1B) | L(OCF1A) | L(TOV1);     
+    private_::overflow_count = 0;
+    // Clear a pending overflow. Writing one clears the flag.
+    TIFR1 = L(ICF1) | L(OCF1B) | L(OCF1A) | H(TOV1);     
+    // Only the overflow interrupt, which extends the ticks to 32 bits.
+    TIMSK1 = L(ICIE1) | L(OCIE1B) | L(OCIE1A) | H(TOIE1);
+  }
+
+  // Interrupt on timer1 overflow. Once every ~262ms and kept short since it
+  // may delay the LIN ISR.
+  ISR(TIMER1_OVF_vect)
+  {
+    private_::overflow_count++;
   }
   
 }  // namespace hardware_clock
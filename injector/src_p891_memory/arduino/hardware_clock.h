@@ -16,40 +16,81 @@
 #include <arduino.h>
 #include "avr_util.h"
 
-// Provides a free running 16 bit counter with 250 ticks per millisecond and 
-// about 280 millis cycle time. Assuming 16Mhz clock.
+// Timer1 based clock with 4 usec ticks. The 16 bit timer counter is extended
+// to 32 bits by counting its overflows with a short timer1 overflow interrupt,
+// once every ~262ms. The 32 bit ticks wrap around every ~4.7 hours.
 //
-// USES: timer 1, no interrupts.
+// None of the functions here disable interrupts.
 namespace hardware_clock {
+  // Private state. Do not use from other files.
+  namespace private_ {
+    // The high 16 bits of the 32 bit ticks. Incremented by the timer1 overflow
+    // ISR.
+    extern volatile uint16 overflow_count;
+  }
+
   // Call once from main setup(). Tick count starts at 0.
   extern void setup();
 
   // Free running 16 bit counter. Starts counting from zero and wraps around
-  // every ~280ms.
-  // Assumes interrupts are enabled upon entry.
+  // every ~262ms.
   // DO NOT CALL THIS FROM AN ISR.
   inline uint16 ticksForNonIsr() {
-    // We disable interrupt to avoid corruption of the AVR temp byte buffer
-    // that is used to read 16 bit values.
-    // TODO: can we avoid disabling interrupts (motivation: improve LIN ISR jitter).
-    cli();
-    const uint16 result TCNT1;
-    sei();
-    return result;
+    // An ISR that accesses a 16 bit timer1 register between the two byte reads
+    // of TCNT1 corrupts the AVR temp byte that holds the high byte. Instead of
+    // disabling interrupts, we read twice and retry unless the two reads are
+    // within a tick, which a corrupted high byte would violate.
+    for (;;) {
+      const uint16 first = TCNT1;
+      const uint16 second = TCNT1;
+      if ((uint16)(second - first) <= 1) {
+        return second;
+      }
+    }
   }
 
-  // Similar to ticksNonIsr but does not enable interrupts.
+  // Similar to ticksNonIsr but reads the counter once.
   // CALL THIS FROM ISR ONLY.
   inline uint16 ticksForIsr() {
     return TCNT1; 
   }
 
+  // Monotonic 32 bit ticks.
+  // DO NOT CALL THIS FROM AN ISR.
+  inline uint32 ticks32ForNonIsr() {
+    // Retry if the overflow ISR ran while reading, including between the two
+    // byte reads of overflow_count.
+    for (;;) {
+      const uint16 high = private_::overflow_count;
+      const uint16 low = ticksForNonIsr();
+      if (high == private_::overflow_count) {
+        return ((uint32)high << 16) | low;
+      }
+    }
+  }
+
+  // Similar to ticks32ForNonIsr but for the case the overflow ISR cannot run.
+  // CALL THIS FROM ISR ONLY.
+  inline uint32 ticks32ForIsr() {
+    uint16 high = private_::overflow_count;
+    const uint16 low = TCNT1;
+    // An overflow whose ISR is still pending. A low value tells the read was
+    // after it.
+    if ((TIFR1 & H(TOV1)) && low < 0x8000) {
+      high++;
+    }
+    return ((uint32)high << 16) | low;
+  }
+
 #if F_CPU != 16000000
 #error "The existing code assumes 16Mhz CPU clk."
 #endif
 
   // @ 16Mhz / x64 prescaler. Number of ticks per a millisecond.
   const uint32 kTicksPerMilli = 250;
+
+  // The duration of a tick.
+  const uint8 kMicrosPerTick = 4;
 }  // namespace hardware_clock
 
 #endif  
@@ -23,6 +23,9 @@ namespace injector_actions {
   
   // Force the output bit to be 0, regardless of the input bit.
   static const uint8 FORCE_BIT_0 = 2;
+
+  // Transfer the inverse of the input bit.
+  static const uint8 INVERT_BIT = 3;
 }  // namespace injector_actions
 
 #endif
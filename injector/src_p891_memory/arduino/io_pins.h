@@ -16,91 +16,85 @@
 #include "avr_util.h"
 
 namespace io_pins {
-  // A class to abstract an output pin that is not necesarily an arduino 
-  // digital pin. Also optimized for fast setOn/Off.
-  //
-  // Assumes that interrupts are enabled and thus should not be called
-  // from ISRs.
-  class OutputPin {
+  // Port tags for Pin. Each provides the PORTx, DDRx and PINx registers of a port.
+  struct PortB {
+    static inline volatile uint8& port() { return PORTB; }
+    static inline volatile uint8& ddr() { return DDRB; }
+    static inline volatile uint8& pin() { return PINB; }
+  };
+
+  struct PortC {
+    static inline volatile uint8& port() { return PORTC; }
+    static inline volatile uint8& ddr() { return DDRC; }
+    static inline volatile uint8& pin() { return PINC; }
+  };
+
+  struct PortD {
+    static inline volatile uint8& port() { return PORTD; }
+    static inline volatile uint8& ddr() { return DDRD; }
+    static inline volatile uint8& pin() { return PIND; }
+  };
+
+  // A pin of a port, e.g. Pin<PortD, 7>. All the methods are static and the
+  // pin has no state, so it is typically used as a typedef. The register
+  // addresses and the bit mask are compile time constants so each access
+  // compiles to a single sbi, cbi, sbic or sbis instruction, the same as direct
+  // register access. The bit instructions are atomic, so the pins can be used
+  // from both ISRs and the main thread without disabling interrupts.
+  template <class Port, uint8 kBitIndex>
+  class Pin {
    public:
-    // port is either PORTB, PORTC, or PORTD.
-    // bit index is one of [7, 6, 5, 4, 3, 2, 1, 0] (lsb).
-    // NOTE: ddr port is is always one address below portx.
-    // NOTE: pin port is is always two addresses below portx.
-    OutputPin(volatile uint8& port, uint8 bitIndex) :
-    port_(port),
-    pin_(*((&port)-2)),
-    bit_mask_(1 << bitIndex) {
-      // NOTE: ddr port is is always one address below port.
-      volatile uint8& ddr = *((&port)-1);
-      ddr |= bit_mask_;
-      low();  // default state.
-    } 
-
-    inline void high() {
-      // Wrapping in cli/sei in case any pin of this port is changed
-      // from an ISR. Keeping this as short as possible to avoid jitter
-      // in the ISR invocation.
-      cli();
-      port_ |= bit_mask_;
-      sei();
+    static const uint8 kPinMask = H(kBitIndex);
+
+    // Make this an output pin with the given initial value.
+    static inline void setupOutput(boolean is_high) {
+      set(is_high);
+      Port::ddr() |= kPinMask;
     }
 
-    inline void low() {
-      // Wrapping in cli/sei in case any pin of this port is changed
-      // from an ISR. Keeping this as short as possible to avoid jitter
-      // in the ISR invocation.
-      cli();
-      port_ &= ~bit_mask_;
-      sei();
+    // Make this an input pin with an active pullup.
+    static inline void setupInput() {
+      Port::ddr() &= ~kPinMask;
+      Port::port() |= kPinMask;
     }
 
-    inline void set(boolean v) {
-      if (v) {
-        high();
-      } 
-      else {
-        low();
-      }
+    static inline void setHigh() {
+      Port::port() |= kPinMask;
     }
 
-    inline void toggle() {
-      set(!isHigh());
+    static inline void setLow() {
+      Port::port() &= ~kPinMask;
     }
 
-    inline boolean isHigh() {
-      return pin_ & bit_mask_;
+    static inline void set(boolean is_high) {
+      if (is_high) {
+        setHigh();
+      } else {
+        setLow();
+      }
     }
 
-   private:
-    volatile uint8& port_;
-    volatile uint8& pin_;
-    const uint8 bit_mask_;
-  };
+    // Writing one to a PINx bit toggles its PORTx bit.
+    static inline void toggle() {
+      Port::pin() = kPinMask;
+    }
 
-  // A class to abstract an input pin that is not necesarily an arduino 
-  // digital pin. Also optimized for quick access.
-  class InputPin {
-   public:
-    // See OutputPin() for description of the args.
-    InputPin(volatile uint8& port, uint8 bitIndex) 
-    : 
-      pin_(*((&port)-2)),
-      bit_mask_(1 << bitIndex) { 
-        volatile uint8& ddr = *((&port)-1);
-        ddr &= ~bit_mask_;  // input
-        port |= bit_mask_;  // pullup
-      } 
-
-    inline boolean isHigh() {
-      return pin_ & bit_mask_;
+    // The input level of the pin.
+    static inline boolean isHigh() {
+      return Port::pin() & kPinMask;
+    }
+
+    // The value last set to an output pin. Unlike isHigh(), does not lag
+    // behind a change by the input synchronizer.
+    static inline boolean isOutputHigh() {
+      return Port::port() & kPinMask;
     }
 
    private:
-    volatile uint8& pin_;
-    const uint8 bit_mask_;
+    // Do not instantiate.
+    Pin() {
+    }
   };
-  
 }  // namespace io_pins
 
 #endif
@@ -13,9 +13,8 @@
 #include "leds.h"
 
 namespace leds {
-  io_pins::OutputPin status(PORTD, 7);
-  ActionLed frames(PORTB, 0);
-  ActionLed errors(PORTB, 1);
+  ActionLed<io_pins::Pin<io_pins::PortB, 0> > frames;
+  ActionLed<io_pins::Pin<io_pins::PortB, 1> > errors;
 }  // namepsace leds
 
 
@@ -20,18 +20,17 @@
 // Defines the three leds.
 namespace leds {
   // STATUS LED - indicates custom module and injector events.
-  extern io_pins::OutputPin status;
+  typedef io_pins::Pin<io_pins::PortD, 7> status;
 
   // FRAMES LED - indicates normal activity.
-  extern ActionLed frames;
+  extern ActionLed<io_pins::Pin<io_pins::PortB, 0> > frames;
 
   // ERRORS LED - blinks when detecting errors.
-  extern ActionLed errors;
+  extern ActionLed<io_pins::Pin<io_pins::PortB, 1> > errors;
 
-  // Called from the main loop()
-  inline void loop() {
-    frames.loop();
-    errors.loop();  
+  // Called once from setup(). The action leds are set up by their constructors.
+  inline void setup() {
+    status::setupOutput(false);
   }
 }  // namepsace leds
 
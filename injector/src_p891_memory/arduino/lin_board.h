@@ -0,0 +1,38 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LIN_BOARD_H
+#define LIN_BOARD_H
+
+#include "avr_util.h"
+#include "io_pins.h"
+
+// Compile time description of the LIN interfaces of the board, shared by
+// lin_processor and lin_sniffer. Channel 1 faces the master and channel 2 the
+// slave. The pins are io_pins::Pin types, so code that is templated on them
+// compiles to direct bit instructions with no runtime pin selection.
+struct LinBoard {
+  // Master LIN interface.
+  typedef io_pins::Pin<io_pins::PortD, 2> Rx1Pin;
+  typedef io_pins::Pin<io_pins::PortC, 2> Tx1Pin;
+
+  // Slave LIN interface.
+  typedef io_pins::Pin<io_pins::PortC, 1> Rx2Pin;
+  typedef io_pins::Pin<io_pins::PortD, 4> Tx2Pin;
+
+ private:
+  // Do not instantiate.
+  LinBoard() {
+  }
+};
+
+#endif
@@ -14,6 +14,7 @@
 #define LIN_FRAME_H
 
 #include "avr_util.h"
+#include "custom_defs.h"
 
 // A buffer for a single frame.
 class LinFrame {
@@ -29,6 +30,17 @@ public:
   // Number of bytes in the longest frame. One ID byte, 8 data bytes, one checksum byte.
   static const uint8 kMaxBytes = 1 + 8 + 1;
 
+  // The side that published the response of the frame. Like enum but 8 bits only.
+  // Frames without a response have PUBLISHER_NONE.
+  static const uint8 PUBLISHER_NONE = 0;
+  static const uint8 PUBLISHER_MASTER = 1;
+  static const uint8 PUBLISHER_SLAVE = 2;
+  // The response was sent by the injector in place of the slave.
+  static const uint8 PUBLISHER_INJECTOR = 3;
+
+  // Return a one letter name of a publisher value.
+  static char publisherLetter(uint8 publisher);
+
   // Compute the to checkum bits [P1,P0] of the lin id in bits [5:0] and return
   // [P1,P0][5:0] which is the wire representation of this id.
   static uint8 setLinIdChecksumBits(uint8 id);
@@ -37,11 +49,18 @@ public:
   
   // Compute LIN frame checksum. Assuming buffer has at least one byte. A valid 
   // frame should contain one byte for id, 1-8 bytes for data, one byte for checksum.
+  // Uses the checksum model of the frame id.
   uint8 computeChecksum() const;
 
+  // Similar to computeChecksum() but with the given model. enhanced is true for
+  // the LIN 2.x model (includes the id byte) and false for the classic model.
+  uint8 computeChecksum(boolean enhanced) const;
+
   inline void reset() {
     num_bytes_ = 0;
     has_injected_bits_ = false;
+    publisher_ = PUBLISHER_NONE;
+    echo_mismatches_ = 0;
   }
   
   inline boolean hasInjectedBits() const {
@@ -67,6 +86,24 @@ public:
     has_injected_bits_ |= byte_has_injected_bits;
   }
   
+  inline uint8 publisher() const {
+    return publisher_;
+  }
+
+  inline void set_publisher(uint8 publisher) {
+    publisher_ = publisher;
+  }
+
+  // Number of proxied bits whose echo on the transmitting side did not match the
+  // level the injector drove. Counted only if custom_defs::kUseEchoVerify.
+  inline uint8 echo_mismatches() const {
+    return echo_mismatches_;
+  }
+
+  inline void add_echo_mismatch() {
+    echo_mismatches_++;
+  }
+
   // TODO: make this stuff private without sacrifying performance.
   
 private:
@@ -81,8 +118,61 @@ private:
   // injector forced a 0 or 1 bit, regardless if the original value of the bit was
   // the same or not.
   boolean has_injected_bits_;
+
+  // One of the PUBLISHER_ values.
+  uint8 publisher_;
+
+  uint8 echo_mismatches_;
 };
 
+// Checksum model of each frame id. Real buses mix LIN 1.x nodes with classic
+// checksums and LIN 2.x nodes with enhanced checksums, and the diagnostic frames
+// (0x3c, 0x3d) always use classic checksums. The diagnostic ids are fixed. The
+// model of any other id is learned once 3 (kRequiredModelReports) consecutive
+// frames of the id have a checksum that matches exactly one of the models, the
+// same one. A frame that matches the other model restarts the count with that
+// model, and frames that match both or neither do not change it. Until the model
+// is learned, frames of the id are valid with either model and checksums are
+// generated with custom_defs::kUseLinChecksumVersion2.
+namespace checksum_models {
+  // Like enum but 8 bits only.
+  static const uint8 UNKNOWN = 0;
+  static const uint8 CLASSIC = 1;
+  static const uint8 ENHANCED = 2;
+
+  // Private state. Do not use from other files.
+  namespace private_ {
+    // Bit sets indexed by the 6 bit id. An id is enhanced only if it is known.
+    // Written by main with single byte writes, enhanced bit first, so the ISR
+    // always sees a consistent model.
+    extern uint8 known_ids[8];
+    extern uint8 enhanced_ids[8];
+  }
+
+  // Return the model of the given id. id is either the 6 bit id or the id byte
+  // with the parity bits.
+  inline uint8 modelOf(uint8 id) {
+    const uint8 id6 = id & 0x3f;
+    const uint8 mask = bitMask(id6 & 0x07);
+    if (!(private_::known_ids[id6 >> 3] & mask)) {
+      return UNKNOWN;
+    }
+    return (private_::enhanced_ids[id6 >> 3] & mask) ? ENHANCED : CLASSIC;
+  }
+
+  // True if the checksums of the given id should include the id byte. Unknown
+  // ids use the default model. Short enough to be called from ISR.
+  inline boolean isEnhanced(uint8 id) {
+    const uint8 model = modelOf(id);
+    return model == UNKNOWN ? custom_defs::kUseLinChecksumVersion2 : (model == ENHANCED);
+  }
+
+  // Learn the model of the frame id, if not known yet. The model is set once a
+  // few consecutive frames of the id agree on it. Called from main for each
+  // recieved frame, before isValid().
+  extern void learnFrame(const LinFrame& frame);
+}
+
 #endif  
 
 
@@ -17,6 +17,10 @@
 #include "avr_util.h"
 #include "hardware_clock.h"
 #include "custom_injector.h"
+#include "io_pins.h"
+#include "gateway.h"
+#include "lin_board.h"
+#include "lin_sniffer.h"
 
 // TODO: for debugging. Remove.
 #include "sio.h"
@@ -34,39 +38,6 @@ static const uint16 kDefaultBaud = 9600;
 //
 static const uint8 kMaxSpaceBits = 6;
 
-// Define an input pin with fast access. Using the macro does
-// not increase the pin access time compared to direct bit manipulation.
-// Pin is setup with active pullup.
-#define DEFINE_INPUT_PIN(name, port_letter, bit_index) \
-  namespace name { \
-    static const uint8 kPinMask  = H(bit_index); \
-    static inline void setup() { \
-      DDR ## port_letter &= ~kPinMask;  \
-      PORT ## port_letter |= kPinMask;  \
-    } \
-    static inline uint8 isHigh() { \
-      return  PIN##port_letter & kPinMask; \
-    } \
-  } 
- 
-// Define an output pin with fast access. Using the macro does
-// not increase the pin access time compared to direct bit manipulation.
-#define DEFINE_OUTPUT_PIN(name, port_letter, bit_index, initial_value) \
-  namespace name { \
-    static const uint8 kPinMask  = H(bit_index); \
-    static inline void setHigh() { \
-      PORT ## port_letter |= kPinMask; \
-    } \
-    static inline void setLow() { \
-      PORT ## port_letter &= ~kPinMask; \
-    } \
-    static inline void setup() { \
-      DDR ## port_letter |= kPinMask;  \
-      (initial_value) ? setHigh() : setLow(); \
-    } \
-  }  
-  
-
 namespace lin_processor {
 
   class Config {
@@ -91,6 +62,18 @@ namespace lin_processor {
       clock_ticks_per_bit_ = (hardware_clock::kTicksPerMilli * 1000) / baud;
       clock_ticks_per_half_bit_ = clock_ticks_per_bit_ / 2;
       clock_ticks_per_until_start_bit_ = clock_ticks_per_bit_ * kMaxSpaceBits;
+      // The rx edges of a followed byte are at the bit boundaries, half a bit
+      // after the ticks, so they are followed only in a window from 1/4 to 3/4
+      // of the bit. This covers a bit rate mismatch of 2% up to the stop bit.
+      // Edges outside of the window are still proxied by the next tick, half a
+      // bit late.
+      //
+      // CPU budget: the ISR is busy for the window, half of each bit of a
+      // followed byte (26us at 19200 baud), rather than for most of the bit when
+      // following from tick to tick. This is also the longest that the main loop
+      // and the timer1 overflow ISR are held off by the following.
+      counts_follow_start_ = counts_per_bit_ / 4;
+      counts_follow_end_ = counts_per_bit_ - counts_follow_start_;
     }
 
     inline uint16 baud() const { 
@@ -116,6 +99,12 @@ namespace lin_processor {
     inline uint8 clock_ticks_per_until_start_bit() const { 
       return clock_ticks_per_until_start_bit_; 
     }
+    inline uint8 counts_follow_start() const {
+      return counts_follow_start_;
+    }
+    inline uint8 counts_follow_end() const {
+      return counts_follow_end_;
+    }
    private:
     uint16 baud_;
     // False -> x8, true -> x64.
@@ -127,6 +116,8 @@ namespace lin_processor {
     uint8 clock_ticks_per_bit_;
     uint8 clock_ticks_per_half_bit_;
     uint8 clock_ticks_per_until_start_bit_;
+    uint8 counts_follow_start_;
+    uint8 counts_follow_end_;
   };
 
   // The actual configurtion. Initialized in setup() based on baud rate.  
@@ -134,35 +125,35 @@ namespace lin_processor {
 
   // ----- Digital I/O pins
   //
-  // NOTE: we use direct register access instead the abstractions in io_pins.h. 
-  // This way we shave a few cycles from the ISR.
+  // NOTE: the io_pins::Pin accesses compile to single bit instructions so they
+  // add no cycles to the ISR compared to direct register access.
     
   // Master LIN interface.
-  DEFINE_INPUT_PIN(rx1_pin, D, 2);
-  DEFINE_OUTPUT_PIN(tx1_pin, C, 2, 1);
+  typedef LinBoard::Rx1Pin rx1_pin;
+  typedef LinBoard::Tx1Pin tx1_pin;
   
   // Slave LIN interface.  
-  DEFINE_INPUT_PIN(rx2_pin, C, 1);
-  DEFINE_OUTPUT_PIN(tx2_pin, D, 4, 1);
+  typedef LinBoard::Rx2Pin rx2_pin;
+  typedef LinBoard::Tx2Pin tx2_pin;
   
   // Debugging signals.
-  DEFINE_OUTPUT_PIN(break_pin, C, 0, 0);
-  DEFINE_OUTPUT_PIN(sample_pin, B, 4, 0);
-  DEFINE_OUTPUT_PIN(error_pin, B, 3, 0);
-  DEFINE_OUTPUT_PIN(isr_pin, C, 3, 0);
-  DEFINE_OUTPUT_PIN(gp_pin, D, 6, 0);
+  typedef io_pins::Pin<io_pins::PortC, 0> break_pin;
+  typedef io_pins::Pin<io_pins::PortB, 4> sample_pin;
+  typedef io_pins::Pin<io_pins::PortB, 3> error_pin;
+  typedef io_pins::Pin<io_pins::PortC, 3> isr_pin;
+  typedef io_pins::Pin<io_pins::PortD, 6> gp_pin;
 
   // Called one during initialization.
   static inline void setupPins() {
-    rx1_pin::setup();
-    tx1_pin::setup();
-    rx2_pin::setup();
-    tx2_pin::setup();
-    break_pin::setup();
-    sample_pin::setup();
-    error_pin::setup();
-    isr_pin::setup();
-    gp_pin::setup();
+    rx1_pin::setupInput();
+    tx1_pin::setupOutput(true);
+    rx2_pin::setupInput();
+    tx2_pin::setupOutput(true);
+    break_pin::setupOutput(false);
+    sample_pin::setupOutput(false);
+    error_pin::setupOutput(false);
+    isr_pin::setupOutput(false);
+    gp_pin::setupOutput(false);
   }
 
   // ----- ISR RX Ring Buffers -----
@@ -210,8 +201,8 @@ namespace lin_processor {
   // reduce ISR jitter time.
   static volatile uint8 isr_marker;
   
-  // Should be called from main only. 
-  static inline void waitForIsrEnd() {
+  // Public. Called from main. See .h for description.
+  void waitForIsrEnd() {
     const uint8 value = isr_marker;
     // Wait until the next ISR ends.
     while (value == isr_marker) {
@@ -241,6 +232,7 @@ namespace lin_processor {
   namespace states {
     static const uint8 DETECT_BREAK = 1;
     static const uint8 READ_DATA = 2;
+    static const uint8 SEND_RESPONSE = 3;
   }
   static uint8 state;
 
@@ -258,6 +250,7 @@ namespace lin_processor {
     // Should be called after the break stop bit was detected.
     static inline void enter();
     static inline void handleIsr();
+    static inline void handleFollowWindowIsr();
     
    private:
     // Indicates if we read bytes from master (true) or slave (false).
@@ -278,6 +271,13 @@ namespace lin_processor {
     // Buffer for the current proxied byte. This byte includes any signal 
     // injection done on this frame.
     static uint8 byte_buffer_;
+
+    // Buffer for the current byte as recieved, before any signal injection. Used
+    // by the injector to verify the checksum of the incoming frame.
+    static uint8 original_byte_buffer_;
+
+    // The value of the last rx bit read by proxyRxBit(), before transformation.
+    static boolean is_original_rx_high_;
     
     // When collecting the data bits, this goes (1 << 0) to (1 << 7). Could
     // be computed as (1 << (bits_read_in_byte_ - 1)). We use this cached value
@@ -287,9 +287,62 @@ namespace lin_processor {
     // When true, the byte buffer has at least one injected bit. That is, a bit that 
     // was forced to 1 or 0 by the injector, regardless of the original bit value.
     static boolean byte_buffer_has_injected_bits_;
+
+    // When true, the current byte is proxied by following the rx edges rather
+    // than by the mid bit samples. The samples are still used to collect the byte.
+    static boolean follow_edges_;
+
+    // Set by a tick to have the follow window of its bit follow the rx edges.
+    // Cleared by the next tick.
+    static boolean is_follow_window_armed_;
+
+    // True if the gateway blocks the header of the current frame from the slave.
+    static boolean is_header_blocked_;
+
+    // True if the gateway blocks the current byte. Blocked bytes are proxied as
+    // recessive bits and are collected as recieved.
+    static boolean is_blocked_;
         
     static inline boolean proxyRxBit();
+    static inline void verifyEcho(boolean is_echo_high, boolean is_tx_high);
     static inline uint8 nextBitFunction();
+    static inline boolean nextByteFollowsEdges();
+  };
+
+  // Sends a substitute response to the master on the bit ticks, reading back each
+  // bit.
+  class StateSendResponse {
+   public:
+    // Should be called at the end of the stop bit of the id byte, after filling
+    // tx_buffer() with num_bytes data and checksum bytes.
+    static inline void enter(uint8 num_bytes);
+    static inline void handleIsr();
+
+    static inline uint8* tx_buffer() {
+      return tx_buffer_;
+    }
+
+   private:
+    // Bit slots of a byte. A tick starts a new slot.
+    static const uint8 kStartSlot = 0;
+    static const uint8 kStopSlot = 9;
+    // The response space before the first byte.
+    static const uint8 kSpaceSlot = 10;
+
+    static uint8 tx_buffer_[LinFrame::kMaxBytes - 1];
+    static uint8 tx_bytes_;
+
+    // Number of bytes sent and verified so far.
+    static uint8 bytes_sent_;
+
+    // The slot in progress and the level we drive in it.
+    static uint8 slot_;
+    static boolean is_tx_high_;
+
+    // The slot that starts at the next tick and the level to drive in it. Computed
+    // in advance so the output changes at a fixed short delay from the tick.
+    static uint8 next_slot_;
+    static boolean next_tx_high_;
   };
 
   // ----- Error Flag. -----
@@ -330,6 +383,7 @@ namespace lin_processor {
     { errors::SYNC_BYTE, "SYNC" },
     { errors::BUFFER_OVERRUN, "OVRN" },
     { errors::OTHER, "OTHR" },
+    { errors::TX_COLLISION, "COLL" },
   };
 
   // Given a byte with lin processor error bitset, print the list
@@ -350,6 +404,59 @@ namespace lin_processor {
     }
   }
 
+  // ----- Frame Completion -----
+
+  // Called from ISR at the end of a frame that was read ok so far. Moves to the next
+  // frame in the ring buffer.
+  // NOTE: we will reset the byte_count of the new frame buffer next time we will enter data detect state.
+  // NOTE: verification of sync byte, id, checksum, etc is done latter by the main code, not the ISR.
+  static inline void completeFrame() {
+    incrementHeadFrameBuffer();
+    if (tail_frame_buffer == head_frame_buffer) {
+      // Frame buffer overrun. We drop the oldest frame and continue with this one.       
+      setErrorFlags(errors::BUFFER_OVERRUN);
+      incrementTailFrameBuffer();
+    }
+  }
+
+  // ----- Edge Following -----
+  //
+  // The propagation delay of the edge following proxy is the period of the
+  // followRxStep() loop plus the delays of the two transceivers, so it is
+  // measured on the board. gp_pin is high while the edges are followed. With a
+  // scope, probe the LIN bus of the sending side, the LIN bus of the recieving
+  // side and gp_pin. Trigger on the falling edges of the sending side and
+  // measure the delay to the recieving side over many frames, for edges with
+  // gp_pin high. The spread of the delay is the loop period. Edges with gp_pin
+  // low are outside of the follow window and are proxied by the next tick.
+
+  // Copy rx1 to tx2 or rx2 to tx1 once, by the given pins. This is the inner loop
+  // of the edge following proxy.
+  template <class RxPin, class TxPin>
+  static inline void followRxStep() {
+    if (RxPin::isHigh()) {
+      TxPin::setHigh();
+    } else {
+      TxPin::setLow();
+    }
+  }
+
+  // Follow the rx edges until the tick timer reaches end_count. Called from the ISR.
+  static inline void followRxUntil(boolean use_rx1, uint8 end_count) {
+    gp_pin::setHigh();
+    if (use_rx1) {
+      while (TCNT2 < end_count) {
+        followRxStep<rx1_pin, tx2_pin>();
+      }
+    } else {
+      while (TCNT2 < end_count) {
+        followRxStep<rx2_pin, tx1_pin>();
+      }
+    }
+    gp_pin::setLow();
+  }
+
+
   // ----- Initialization -----
 
   static void setupTimer() {    
@@ -371,6 +478,12 @@ namespace lin_processor {
     OCR2B = config.counts_per_bit() - 2; 
     // Interrupt on A match.
     TIMSK2 = L(OCIE2B) | H(OCIE2A) | L(TOIE2);
+    // When following edges, the B match starts the follow window of each bit.
+    // The OC2B pulse then spans from the window start to the end of the cycle.
+    if (custom_defs::kUseEdgeFollowingProxy) {
+      OCR2B = config.counts_follow_start();
+      TIMSK2 = H(OCIE2B) | H(OCIE2A) | L(TOIE2);
+    }
     // Clear pending Compare A interrupts.
     TIFR2 = L(OCF2B) | H(OCF2A) | L(TOV2);
   }
@@ -397,6 +510,14 @@ namespace lin_processor {
         config.clock_ticks_per_bit(),  
         config.clock_ticks_per_half_bit(),  
         config.clock_ticks_per_until_start_bit());
+    // The edge follow window, in timer2 counts, and the added propagation delay
+    // of the mid bit sampling, half a bit. The delay of the edge following is
+    // measured with a scope, see followRxStep().
+    sio::printf(F("LIN delay: follow=%u, window=%u-%u, mid bit=%u us\n"),
+        custom_defs::kUseEdgeFollowingProxy,
+        config.counts_follow_start(),
+        config.counts_follow_end(),
+        (uint16)(500000L / config.baud()));
   }
 
   // ----- ISR Utility Functions -----
@@ -434,22 +555,20 @@ namespace lin_processor {
     } 
   }
   
-  static inline boolean isRxHigh(boolean use_rx1) {
-    return use_rx1 ? rx1_pin::isHigh() : rx2_pin::isHigh(); 
-  } 
-
-  // Perform a tight busy loop until RX is low or the given number
+  // Perform a tight busy loop until the given RX pin is low or the given number
   // of clock ticks passed (timeout). Retuns true if ok,
-  // false if timeout. Keeps timer reset during the wait.
+  // false if timeout. Keeps timer reset during the wait. The pin is a template
+  // parameter so the loop has no channel selection.
   // Called from ISR only.
-  static inline boolean waitForRxLow(uint16 max_clock_ticks, boolean use_rx1) {
+  template <class RxPin>
+  static inline boolean waitForRxLow(uint16 max_clock_ticks) {
     const uint16 base_clock = hardware_clock::ticksForIsr();
     for(;;) {
       // Keep the tick timer not ticking (no ISR).
       resetTickTimer();
 
       // If selected rx is low we are done.
-      if (!isRxHigh(use_rx1)) {
+      if (!RxPin::isHigh()) {
         return true;
       }
 
@@ -465,11 +584,12 @@ namespace lin_processor {
   // Same as waitForRxLow but with reversed polarity.
   // We clone to code for time optimization.
   // Called from ISR only.
-  static inline boolean waitForRxHigh(uint16 max_clock_ticks, boolean use_rx1) {
+  template <class RxPin>
+  static inline boolean waitForRxHigh(uint16 max_clock_ticks) {
     const uint16 base_clock = hardware_clock::ticksForIsr();
     for(;;) {
       resetTickTimer();
-      if (isRxHigh(use_rx1)) {
+      if (RxPin::isHigh()) {
         return true;
       }
       // Should work also in case of an clock overflow.
@@ -551,12 +671,17 @@ namespace lin_processor {
     break_pin::setHigh();
 
     // TODO: set actual max count
-    waitForRxHigh(255, true);
+    waitForRxHigh<rx1_pin>(255);
     break_pin::setLow();
 
     // Wait for half a bit before we propogate the end of the break
-    // to the slave. The slave is delayed by half a bit.
-    wait(config.clock_ticks_per_half_bit());
+    // to the slave. The slave is delayed by half a bit. When following
+    // edges, the sync byte is not delayed so neither is the end of the
+    // break (the break is shortened by up to one bit since its start was
+    // detected by the ticks).
+    if (!custom_defs::kUseEdgeFollowingProxy) {
+      wait(config.clock_ticks_per_half_bit());
+    }
     tx2_pin::setHigh();
    
     // Go process the data
@@ -570,8 +695,14 @@ namespace lin_processor {
   boolean StateReadData::rx_from_lin1_;
   byte StateReadData::rx_bit_transfer_function_;
   uint8 StateReadData::byte_buffer_;
+  uint8 StateReadData::original_byte_buffer_;
+  boolean StateReadData::is_original_rx_high_;
   uint8 StateReadData::byte_buffer_bit_mask_;
   boolean StateReadData::byte_buffer_has_injected_bits_;
+  boolean StateReadData::follow_edges_;
+  boolean StateReadData::is_follow_window_armed_;
+  boolean StateReadData::is_header_blocked_;
+  boolean StateReadData::is_blocked_;
 
   // Called after half a bit after the low to high transition at the end of the break.
   inline void StateReadData::enter() {
@@ -583,23 +714,58 @@ namespace lin_processor {
     // True = reading from master, sending to slave.
     rx_from_lin1_ = true;
     rx_bit_transfer_function_ = injector_actions::COPY_BIT;
+    is_header_blocked_ = false;
+    is_blocked_ = false;
 
     // TODO: handle post break timeout errors.
     // TODO: set a reasonable time limit.
-    waitForRxLow(255, true);
+    waitForRxLow<rx1_pin>(255);
+    // The sync byte is never modified.
+    follow_edges_ = custom_defs::kUseEdgeFollowingProxy;
+    if (follow_edges_) {
+      tx2_pin::setLow();
+    }
     setTimerToHalfTick();   
   }
 
+  // Returns true if the next byte, whose start bit was just detected, should be
+  // proxied by following the rx edges. bytes_read_ does not include it yet.
+  inline boolean StateReadData::nextByteFollowsEdges() {
+    if (!custom_defs::kUseEdgeFollowingProxy) {
+      return false;
+    }
+    // The sync and id bytes are never modified.
+    if (bytes_read_ < 2) {
+      return true;
+    }
+    if (is_blocked_) {
+      return false;
+    }
+    // The injector falls back to mid bit sampling from the first modified byte to
+    // the end of the frame. Switching back would shorten the stop bit of the
+    // last sampled byte by half a bit.
+    return custom_injector::onIsrIsByteUnmodified(bytes_read_ - 2);
+  }
+
+  // Called from ISR when kUseEchoVerify, on a bit tick before the output is
+  // changed. Compares the echo of the transmitting side with the level we drive
+  // since the previous tick, which had most of a bit time to settle.
+  inline void StateReadData::verifyEcho(boolean is_echo_high, boolean is_tx_high) {
+    if (is_echo_high != is_tx_high) {
+      rx_frame_buffers[head_frame_buffer].add_echo_mismatch();
+    }
+  }
+
   // Called from ISR. Read an rx bit and transfer to the other interface with
   // possible transformation. Uses rx_from_lin1_ to determine direction and uses
   // rx_bit_transfer_function to determine bit transformation function.
-  // Returns the read bit post transformation.
+  // Returns the read bit post transformation. The bit before transformation is
+  // stored in is_original_rx_high_.
   //
-  // TODO: currently when forcing a 1 or 0 bit, we completely ignore the input
-  // bit. Ideally we should read it, verify the checksum of the incoming frame
-  // and if invalid (e.g. due to electrical noise), corrupt the checksum of 
-  // the modify frame. Otherwise we may laundering bad bits when recaclulating
-  // the checksum for the transformed frame.
+  // NOTE: the input bit is read also when the output bit is forced. This allows
+  // the injector to verify the checksum of the incoming frame and to avoid
+  // laundering bad bits (e.g. due to electrical noise) when recaclulating the
+  // checksum of the transformed frame.
   inline boolean StateReadData::proxyRxBit() {
     sample_pin::setHigh();
 
@@ -608,24 +774,25 @@ namespace lin_processor {
     
     if (rx_from_lin1_) {
       // Master interface to slave interface transfer.
+      const boolean is_original_rx_high = rx1_pin::isHigh();
+      if (custom_defs::kUseEchoVerify) {
+        verifyEcho(rx2_pin::isHigh(), tx2_pin::isOutputHigh());
+      }
       switch (rx_bit_transfer_function_) {
         case injector_actions::COPY_BIT:
-          is_rx_high = rx1_pin::isHigh();
-          if (is_rx_high) {
-            tx2_pin::setHigh();
-          } else {
-            tx2_pin::setLow();
-          }
+          is_rx_high = is_original_rx_high;
           break;
 
         case injector_actions::FORCE_BIT_1:
           is_rx_high = true;
-          tx2_pin::setHigh();
           break;
   
         case injector_actions::FORCE_BIT_0:
           is_rx_high = false;
-          tx2_pin::setLow();
+          break;
+
+        case injector_actions::INVERT_BIT:
+          is_rx_high = !is_original_rx_high;
           break;
 
         default:
@@ -634,26 +801,33 @@ namespace lin_processor {
           is_rx_high = true;
           break;
       }
+      if (is_rx_high) {
+        tx2_pin::setHigh();
+      } else {
+        tx2_pin::setLow();
+      }
+      is_original_rx_high_ = is_original_rx_high;
     } else {
       // Slave interface to master interface transfer.
+      const boolean is_original_rx_high = rx2_pin::isHigh();
+      if (custom_defs::kUseEchoVerify) {
+        verifyEcho(rx1_pin::isHigh(), tx1_pin::isOutputHigh());
+      }
       switch (rx_bit_transfer_function_) {
         case injector_actions::COPY_BIT:
-          is_rx_high = rx2_pin::isHigh();
-          if (is_rx_high) {
-            tx1_pin::setHigh();
-          } else {
-            tx1_pin::setLow();
-          }
+          is_rx_high = is_original_rx_high;
           break;
 
         case injector_actions::FORCE_BIT_1:
           is_rx_high = true;
-          tx1_pin::setHigh();
           break;
   
         case injector_actions::FORCE_BIT_0:
           is_rx_high = false;
-          tx1_pin::setLow();
+          break;
+
+        case injector_actions::INVERT_BIT:
+          is_rx_high = !is_original_rx_high;
           break;
 
         default:
@@ -662,6 +836,12 @@ namespace lin_processor {
           is_rx_high = true;
           break;
       }
+      if (is_rx_high) {
+        tx1_pin::setHigh();
+      } else {
+        tx1_pin::setLow();
+      }
+      is_original_rx_high_ = is_original_rx_high;
     }
     
     sample_pin::setLow();
@@ -670,6 +850,11 @@ namespace lin_processor {
 
   // Returns the transfer function of the next bit.
   inline uint8 StateReadData::nextBitFunction() {
+    // Bytes blocked by the gateway are all recessive, including the start bit.
+    if (is_blocked_) {
+      return injector_actions::FORCE_BIT_1;
+    }
+
     // Force copy if sync byte, id byte, any start bit or any stop bit.
     if (bytes_read_ < 2 || bits_read_in_byte_ == 0 || bits_read_in_byte_ >= 9) {
       return injector_actions::COPY_BIT;
@@ -680,16 +865,29 @@ namespace lin_processor {
     return custom_injector::onIsrNextBitAction(bytes_read_ - 2, bits_read_in_byte_ - 1);  
   }
   
+  // Called from the timer2 B match ISR at the start of the follow window of each
+  // bit. Follows the rx edges to the end of the window if armed by the tick.
+  inline void StateReadData::handleFollowWindowIsr() {
+    if (!is_follow_window_armed_) {
+      return;
+    }
+    is_follow_window_armed_ = false;
+    followRxUntil(rx_from_lin1_, config.counts_follow_end());
+  }
+
   inline void StateReadData::handleIsr() {
     // Sample and propogated the data bit ASAP to avoid jitter.
     // Since we sample at the middle of the input bit, the output
-    // channel is delayed by 1/2 bit.
+    // channel is delayed by 1/2 bit, unless following the rx edges.
     const boolean is_rx_high = proxyRxBit(); 
+    // Armed again below for the bits whose edges are followed.
+    is_follow_window_armed_ = false;
     
     // Handle byte's start bit.
     if (bits_read_in_byte_ == 0) {
-      // Start bit error.
-      if (is_rx_high) {
+      // Start bit error. Checking the input bit since blocked bytes are proxied as
+      // recessive.
+      if (is_original_rx_high_) {
         // If in sync byte, report as a sync error.
         setErrorFlags(bytes_read_ == 0 ? errors::SYNC_BYTE : errors::START_BIT);
         StateDetectBreak::enter();
@@ -701,9 +899,11 @@ namespace lin_processor {
       bits_read_in_byte_++;
       // Prepare buffer and mask for data bit collection.
       byte_buffer_ = 0;
+      original_byte_buffer_ = 0;
       byte_buffer_bit_mask_ = (1 << 0);
       byte_buffer_has_injected_bits_ = false;
       rx_bit_transfer_function_ = nextBitFunction();
+      is_follow_window_armed_ = follow_edges_;
       return;
     }
 
@@ -713,14 +913,42 @@ namespace lin_processor {
       if (is_rx_high) {
         byte_buffer_ |= byte_buffer_bit_mask_;
       }
+      if (is_original_rx_high_) {
+        original_byte_buffer_ |= byte_buffer_bit_mask_;
+      }
       byte_buffer_bit_mask_ = byte_buffer_bit_mask_ << 1;
       bits_read_in_byte_++;
       // If that bit value was forced by the injector, mark this byte as having injected bits.
       if (rx_bit_transfer_function_ != injector_actions::COPY_BIT) {
         byte_buffer_has_injected_bits_ = true;
       }
+      // Report data and checksum bytes, skipping the sync and frame id bytes. Done
+      // on the last data bit rather than on the stop bit so the injector has a full
+      // bit slot, until the stop bit tick, to update its checksum.
+      if (bits_read_in_byte_ == 9 && bytes_read_ >= 2 && !is_blocked_) {
+        custom_injector::onIsrByteSent(bytes_read_ - 2, byte_buffer_, original_byte_buffer_);
+      }
       // Set the transfer function for the next rx bit.
       rx_bit_transfer_function_ = nextBitFunction();
+
+      // If we just recieved the id, select its gateway policy. A blocked header is
+      // corrupted by a dominant stop bit on the slave side.
+      if (bits_read_in_byte_ == 9 && bytes_read_ == 1) {
+        gateway::onIsrFrameIdRecieved(byte_buffer_);
+        is_header_blocked_ = gateway::onIsrIsHeaderBlocked();
+        if (is_header_blocked_) {
+          rx_bit_transfer_function_ = injector_actions::FORCE_BIT_0;
+          // When following edges the slave sees the stop bit without delay so it
+          // must be dominant from its start, at the next bit boundary.
+          if (follow_edges_) {
+            followRxUntil(true, config.counts_per_half_bit());
+            tx2_pin::setLow();
+            return;
+          }
+        }
+      }
+
+      is_follow_window_armed_ = follow_edges_;
       return;
     }
     
@@ -728,8 +956,9 @@ namespace lin_processor {
     bytes_read_++;
     bits_read_in_byte_ = 0;
 
-    // Error if stop bit is not high.
-    if (!is_rx_high) {
+    // Error if stop bit is not high. Checking the input bit since the stop bit may
+    // be modified by the gateway.
+    if (!is_original_rx_high_) {
       // If in sync byte, report as sync error.
       setErrorFlags(bytes_read_ == 0 ? errors::SYNC_BYTE : errors::STOP_BIT);
       StateDetectBreak::enter();
@@ -754,23 +983,33 @@ namespace lin_processor {
       // If this is the id, data or checksum bytes, append it to the frame buffer.
       // NOTE: the byte limit count is enforeced somewhere else so we can assume safely here that this 
       // will not cause a buffer overlow.
-      rx_frame_buffers[head_frame_buffer].append_byte(byte_buffer_, byte_buffer_has_injected_bits_);    
+      rx_frame_buffers[head_frame_buffer].append_byte(is_blocked_ ? original_byte_buffer_ : byte_buffer_,
+          byte_buffer_has_injected_bits_);    
     }
     
-    // Report data and checksum bytes, skipping the sync and frame id bytes.
-    if (bytes_read_ >= 3) {     
-      // TODO: call this after the 8th data bit, before the stop bit, this way we will have
-      // a full bit slot to comptue the checksum rather than half a bit, until the high to low
-      // transition of the next start bit.
-      custom_injector::onIsrByteSent(bytes_read_ - 3, byte_buffer_);
-    }
-        
     // Determine if there are more bytes.
     boolean has_more_bytes = false;
     if (bytes_read_ == 2) {  
       // This is the case where we just read the id byte from the master.
       // Inform the injector.      
       custom_injector::onIsrFrameIdRecieved(byte_buffer_);
+
+      // Release the corrupted stop bit at its end, after the slave sampled it in
+      // its middle. When following edges the slave's stop bit started half a bit
+      // ago, at the bit boundary. Otherwise it started at this tick, with the
+      // sampled bit, and the slave samples it half a bit from now.
+      if (is_header_blocked_) {
+        wait(follow_edges_ ? config.clock_ticks_per_half_bit() : config.clock_ticks_per_bit());
+        tx2_pin::setHigh();
+
+        // If the gateway answers this frame, send the response instead of waiting
+        // for one. The slave did not see the header.
+        const uint8 num_bytes = gateway::onIsrCopySubstitute(StateSendResponse::tx_buffer());
+        if (num_bytes) {
+          StateSendResponse::enter(num_bytes);
+          return;
+        }
+      }
             
       // Master sent sync and ID bytes and now we need to wait for the response. It can 
       // come from the master (1) or the slave (2), or 0 for timeout.
@@ -778,12 +1017,33 @@ namespace lin_processor {
       const byte lin_channel_ = waitForResponseStartBit(config.clock_ticks_per_until_start_bit());
       has_more_bytes = lin_channel_;
       rx_from_lin1_ = (lin_channel_ != 2);
+      if (has_more_bytes) {
+        rx_frame_buffers[head_frame_buffer].set_publisher(
+            rx_from_lin1_ ? LinFrame::PUBLISHER_MASTER : LinFrame::PUBLISHER_SLAVE);
+      }
+      // The gateway blocks either all the response bytes or none.
+      is_blocked_ = has_more_bytes && gateway::onIsrIsResponseBlocked(rx_from_lin1_);
     } else {
       // This is the case where we don't need to check where the next byte is comming 
       // from.
       //
       // Wait for the high to low transition of start bit of next byte. Using existing channel.
-      has_more_bytes =  waitForRxLow(config.clock_ticks_per_until_start_bit(), rx_from_lin1_);
+      // The channel is selected once, outside of the wait loop.
+      const uint16 max_clock_ticks = config.clock_ticks_per_until_start_bit();
+      has_more_bytes = rx_from_lin1_
+          ? waitForRxLow<rx1_pin>(max_clock_ticks)
+          : waitForRxLow<rx2_pin>(max_clock_ticks);
+    }
+
+    // When following the rx edges, propagate the start bit right away rather than
+    // at its middle.
+    follow_edges_ = has_more_bytes && nextByteFollowsEdges();
+    if (follow_edges_) {
+      if (rx_from_lin1_) {
+        tx2_pin::setLow();
+      } else {
+        tx1_pin::setLow();
+      }
     }
 
     // Handle the case of no more bytes in this frame.
@@ -797,15 +1057,7 @@ namespace lin_processor {
       }
 
       // Frame looks ok so far. Move to next frame in the ring buffer.
-      // NOTE: we will reset the byte_count of the new frame buffer next time we will enter data detect state.
-      // NOTE: verification of sync byte, id, checksum, etc is done latter by the main code, not the ISR.
-      incrementHeadFrameBuffer();
-      if (tail_frame_buffer == head_frame_buffer) {
-        // Frame buffer overrun. We drop the oldest frame and continue with this one.       
-        setErrorFlags(errors::BUFFER_OVERRUN);
-        incrementTailFrameBuffer();
-      }
-
+      completeFrame();
       StateDetectBreak::enter();
       // No need to set the next bit function, we exit the data reading state.
       return;
@@ -821,20 +1073,95 @@ namespace lin_processor {
     }
 
     // Everything is ready for the next byte. Have a tick in the middle of its
-    // start bit, alsywas with a copy function.
+    // start bit, alsywas with a copy function, unless blocked.
     //
     //    
     // TODO: move this to above the num_bytes check above for more accurate 
     // timing of mid bit tick? 
-    rx_bit_transfer_function_ = injector_actions::COPY_BIT;
+    rx_bit_transfer_function_ = is_blocked_ ? injector_actions::FORCE_BIT_1 : injector_actions::COPY_BIT;
     setTimerToHalfTick();
   }
 
+  // ----- Send-Response State Implementation -----
+
+  uint8 StateSendResponse::tx_buffer_[LinFrame::kMaxBytes - 1];
+  uint8 StateSendResponse::tx_bytes_;
+  uint8 StateSendResponse::bytes_sent_;
+  uint8 StateSendResponse::slot_;
+  boolean StateSendResponse::is_tx_high_;
+  uint8 StateSendResponse::next_slot_;
+  boolean StateSendResponse::next_tx_high_;
+
+  inline void StateSendResponse::enter(uint8 num_bytes) {
+    state = states::SEND_RESPONSE;
+    tx_bytes_ = num_bytes;
+    rx_frame_buffers[head_frame_buffer].set_publisher(LinFrame::PUBLISHER_INJECTOR);
+    bytes_sent_ = 0;
+
+    // The slot in progress is the response space. The start bit of the first byte
+    // starts at the next tick, a bit from now, and from there on the ticks are at
+    // the bit boundaries.
+    slot_ = kSpaceSlot;
+    is_tx_high_ = true;
+    next_slot_ = kStartSlot;
+    next_tx_high_ = false;
+    resetTickTimer();
+  }
+
+  inline void StateSendResponse::handleIsr() {
+    // Sample the slot that ends now and start the next one. Both are done first,
+    // at a fixed delay from the tick, for accurate bit timing. Sampling at the
+    // end of the slot allows for the transciever loop delay.
+    const uint8 is_rx_high = rx1_pin::isHigh();
+    if (next_tx_high_) {
+      tx1_pin::setHigh();
+    } else {
+      tx1_pin::setLow();
+    }
+
+    // Verify that the master bus followed the level we sent in the slot that just
+    // ended.
+    if (slot_ != kSpaceSlot && (is_rx_high ? !is_tx_high_ : is_tx_high_)) {
+      setErrorFlags(errors::TX_COLLISION);
+      StateDetectBreak::enter();
+      return;
+    }
+
+    // If the stop bit of a byte just ended, the byte is done.
+    if (slot_ == kStopSlot) {
+      rx_frame_buffers[head_frame_buffer].append_byte(tx_buffer_[bytes_sent_], true);
+      if (++bytes_sent_ >= tx_bytes_) {
+        completeFrame();
+        StateDetectBreak::enter();
+        return;
+      }
+    }
+
+    slot_ = next_slot_;
+    is_tx_high_ = next_tx_high_;
+
+    // Prepare the slot that follows the one that just started.
+    if (slot_ >= kStopSlot) {
+      // After the stop bit, the start bit of the next byte, if any.
+      next_slot_ = kStartSlot;
+      next_tx_high_ = (bytes_sent_ + 1 >= tx_bytes_);
+    } else {
+      // Data bits, lsb first, then the stop bit.
+      next_slot_ = slot_ + 1;
+      next_tx_high_ = (next_slot_ == kStopSlot) || (tx_buffer_[bytes_sent_] & bitMask(slot_));
+    }
+  }
+
   // ----- ISR Handler -----
 
   // Interrupt on Timer 2 A-match.
   ISR(TIMER2_COMPA_vect)
   {
+    // The board runs either as an injector or as a sniffer, sharing this timer.
+    if (custom_defs::kUseDualBusSniffer) {
+      lin_sniffer::onIsrTick();
+      return;
+    }
     isr_pin::setHigh();
     // TODO: make this state a boolean instead of enum? (efficency).
     switch (state) {
@@ -844,6 +1171,9 @@ namespace lin_processor {
     case states::READ_DATA:
       StateReadData::handleIsr();
       break;
+    case states::SEND_RESPONSE:
+      StateSendResponse::handleIsr();
+      break;
     default:
       setErrorFlags(errors::OTHER);
       StateDetectBreak::enter();
@@ -856,5 +1186,13 @@ namespace lin_processor {
     
     isr_pin::setLow();
   }
+
+  // Interrupt on Timer 2 B-match. Enabled only when following the rx edges.
+  ISR(TIMER2_COMPB_vect)
+  {
+    if (state == states::READ_DATA) {
+      StateReadData::handleFollowWindowIsr();
+    }
+  }
 }  // namespace lin_processor
 
@@ -32,6 +32,11 @@ namespace lin_processor {
   // count are not verified. 
   extern boolean readNextFrame(LinFrame* buffer);
 
+  // Wait until the next bit tick ISR returns. Called from main right before
+  // disabling interrupts to update state shared with the ISR, so the update
+  // does not delay a tick. Requires the ISR to be running.
+  extern void waitForIsrEnd();
+
   // Errors byte masks for the individual error bits.
   namespace errors {
     static const uint8 FRAME_TOO_SHORT = (1 << 0);
@@ -41,6 +46,7 @@ namespace lin_processor {
     static const uint8 SYNC_BYTE = (1 << 4);
     static const uint8 BUFFER_OVERRUN = (1 << 5);
     static const uint8 OTHER = (1 << 6);
+    static const uint8 TX_COLLISION = (1 << 7);
   }
 
   // Get current error flag and clear it. 
@@ -0,0 +1,124 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lin_sniffer.h"
+
+#include "custom_defs.h"
+#include "sio.h"
+
+namespace lin_sniffer {
+
+  // Private state of the sniffer. Do not use from other files.
+  namespace private_ {
+    Channel channel1;
+    Channel channel2;
+    volatile uint8 error_flags;
+
+    static void setupChannel(Channel* channel) {
+      channel->state = states::DETECT_BREAK;
+      channel->samples_count = 0;
+      channel->head_frame_buffer = 0;
+      channel->tail_frame_buffer = 0;
+    }
+
+    // Called from main with interrupts disabled.
+    static boolean readChannelFrame(Channel* channel, LinFrame* buffer,
+        uint32* timestamp) {
+      if (channel->tail_frame_buffer == channel->head_frame_buffer) {
+        return false;
+      }
+      // This copies the frame buffer struct.
+      *buffer = channel->frame_buffers[channel->tail_frame_buffer];
+      *timestamp = channel->frame_timestamps[channel->tail_frame_buffer];
+      if (++channel->tail_frame_buffer >= kMaxFrameBuffers) {
+        channel->tail_frame_buffer = 0;
+      }
+      return true;
+    }
+
+    // The channel to read first on the next readNextFrame(). Main only.
+    static boolean read_channel2_first;
+  }
+
+  void setup() {
+    // If baud rate out of range use default speed.
+    uint16 baud = custom_defs::kLinSpeed;
+    if (baud < 1000 || baud > 20000) {
+      sio::println(F("ERROR: kLinSpeed out of range"));
+      baud = 9600;
+    }
+    const boolean prescaler_x64 = baud < 2000;
+    const uint8 prescaling = prescaler_x64 ? 64 : 8;
+    const uint8 counts_per_tick = (16000000L / prescaling) / ((uint32)baud * kSamplesPerBit);
+
+    // RX inputs with pullups.
+    private_::rx1_pin::setupInput();
+    private_::rx2_pin::setupInput();
+    // TX outputs, passive.
+    private_::tx1_pin::setupOutput(true);
+    private_::tx2_pin::setupOutput(true);
+    private_::isr_pin::setupOutput(false);
+
+    private_::setupChannel(&private_::channel1);
+    private_::setupChannel(&private_::channel2);
+    private_::error_flags = 0;
+    private_::read_channel2_first = false;
+
+    // CTC mode, no outputs, interrupt on A match.
+    TCCR2A = L(COM2A1) | L(COM2A0) | L(COM2B1) | L(COM2B0) | H(WGM21) | L(WGM20);
+    TCCR2B = L(FOC2A) | L(FOC2B) | L(WGM22)
+        | (prescaler_x64 ? (H(CS22) | L(CS21) | L(CS20)) : (L(CS22) | H(CS21) | L(CS20)));
+    TCNT2 = 0;
+    OCR2A = counts_per_tick - 1;
+    TIMSK2 = L(OCIE2B) | H(OCIE2A) | L(TOIE2);
+    TIFR2 = L(OCF2B) | H(OCF2A) | L(TOV2);
+
+    sio::waitUntilFlushed();
+    sio::printf(F("LIN sniffer: %u, %u, %u\n"), baud, prescaler_x64, counts_per_tick);
+  }
+
+  boolean readNextFrame(LinFrame* buffer, uint8* channel, uint32* timestamp) {
+    // Disabling interrupts for the frame copy. The ISR is short so this does not
+    // cause sample jitter beyond a tick.
+    cli();
+    // The channel of the frame, zero if none.
+    uint8 channel_number = 0;
+    if (private_::read_channel2_first) {
+      if (private_::readChannelFrame(&private_::channel2, buffer, timestamp)) {
+        channel_number = 2;
+      } else if (private_::readChannelFrame(&private_::channel1, buffer, timestamp)) {
+        channel_number = 1;
+      }
+    } else {
+      if (private_::readChannelFrame(&private_::channel1, buffer, timestamp)) {
+        channel_number = 1;
+      } else if (private_::readChannelFrame(&private_::channel2, buffer, timestamp)) {
+        channel_number = 2;
+      }
+    }
+    sei();
+    private_::read_channel2_first = !private_::read_channel2_first;
+    if (!channel_number) {
+      return false;
+    }
+    *channel = channel_number;
+    return true;
+  }
+
+  uint8 getAndClearErrorFlags() {
+    cli();
+    const uint8 result = private_::error_flags;
+    private_::error_flags = 0;
+    sei();
+    return result;
+  }
+}  // namespace lin_sniffer
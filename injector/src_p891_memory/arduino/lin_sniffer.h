@@ -0,0 +1,262 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LIN_SNIFFER_H
+#define LIN_SNIFFER_H
+
+#include "avr_util.h"
+#include "custom_defs.h"
+#include "hardware_clock.h"
+#include "lin_board.h"
+#include "lin_frame.h"
+#include "lin_processor.h"
+
+// An analyzer personality of the injector board. Decodes the two LIN interfaces
+// as two independent bus monitors, instead of proxying between them. Used when
+// custom_defs::kUseDualBusSniffer is true, in which case lin_processor is not
+// used.
+//
+// Each channel has its own state machine and frame ring. Both are driven from a
+// single Timer2 tick at kSamplesPerBit times the baud rate, with a constant short
+// work per channel per tick and no busy waits, so a channel never blocks the
+// other. readNextFrame() returns the channel of each frame and the hardware clock
+// time of the end of its break.
+//
+// Uses
+// * Timer2 - used to generate the sample ticks (ISR in lin_processor.cpp).
+// * PD2, PC1 - LIN RX inputs of channel 1 and 2.
+// * PC2, PD4 - LIN TX outputs, kept passive (high).
+// * PC3 - debugging output, high during the sample tick work. Its pulses must
+//   stay shorter than the tick period, 13us (208 CPU cycles) at 19200 baud.
+namespace lin_sniffer {
+  // Number of rx samples per bit.
+  static const uint8 kSamplesPerBit = 4;
+
+  // Private state of the sniffer. Do not use from other files.
+  namespace private_ {
+    // The LIN pins of the board. The TX outputs are kept passive.
+    typedef LinBoard::Rx1Pin rx1_pin;
+    typedef LinBoard::Tx1Pin tx1_pin;
+    typedef LinBoard::Rx2Pin rx2_pin;
+    typedef LinBoard::Tx2Pin tx2_pin;
+
+    // Debugging signal, same pin as the ISR signal of lin_processor.
+    typedef io_pins::Pin<io_pins::PortC, 3> isr_pin;
+
+    // Frame ring size, per channel. A single unused buffer when the sniffer is
+    // not selected, so the injector personality does not pay for the rings.
+    static const uint8 kMaxFrameBuffers = custom_defs::kUseDualBusSniffer ? 4 : 1;
+
+    // Min number of low samples of a break. A break is at least 13 bits, a
+    // 0x00 byte with a missing stop bit is 10 bits.
+    static const uint8 kMinBreakSamples = 11 * kSamplesPerBit;
+
+    // Max number of idle samples between the stop bit of a byte and the start bit
+    // of the next byte in the same frame.
+    static const uint8 kMaxSpaceSamples = 6 * kSamplesPerBit;
+
+    // Like enum but 8 bits only.
+    namespace states {
+      static const uint8 DETECT_BREAK = 1;
+      static const uint8 WAIT_START_BIT = 2;
+      static const uint8 READ_BYTE = 3;
+    }
+
+    // State of a single channel. Read/Written by ISR only, except for the frame
+    // ring tail which is also accessed by main with interrupts disabled.
+    struct Channel {
+      uint8 state;
+      // DETECT_BREAK: number of consecutive low samples, up to 255.
+      // WAIT_START_BIT: number of idle samples since the last stop bit.
+      uint8 samples_count;
+      // READ_BYTE: number of ticks until the next bit sample.
+      uint8 ticks_to_sample;
+      // READ_BYTE: 0 for the start bit, 1-8 for the data bits, 9 for the stop bit.
+      uint8 bit_index;
+      uint8 byte_buffer;
+      // Number of complete bytes read in this frame, including the sync byte.
+      uint8 bytes_read;
+      LinFrame frame_buffers[kMaxFrameBuffers];
+      // The 32 bit hardware clock ticks at the end of the break of each frame
+      // buffer.
+      uint32 frame_timestamps[kMaxFrameBuffers];
+      // Index of the frame being written (newest) and of the next frame to be
+      // read (oldest). Equal if there is no available frame.
+      uint8 head_frame_buffer;
+      uint8 tail_frame_buffer;
+    };
+
+    extern Channel channel1;
+    extern Channel channel2;
+
+    // Written from ISR. Read/Write from main.
+    extern volatile uint8 error_flags;
+
+    // Called from ISR on the end of a frame that was read ok.
+    inline void completeFrame(Channel& channel) {
+      if (channel.bytes_read < 2) {
+        // Sync byte only.
+        error_flags |= lin_processor::errors::FRAME_TOO_SHORT;
+        return;
+      }
+      if (++channel.head_frame_buffer >= kMaxFrameBuffers) {
+        channel.head_frame_buffer = 0;
+      }
+      if (channel.head_frame_buffer == channel.tail_frame_buffer) {
+        // Frame buffer overrun. We drop the oldest frame.
+        error_flags |= lin_processor::errors::BUFFER_OVERRUN;
+        if (++channel.tail_frame_buffer >= kMaxFrameBuffers) {
+          channel.tail_frame_buffer = 0;
+        }
+      }
+    }
+
+    // Process one rx sample of a channel. Called from ISR on each tick. Should be
+    // kept short since it's called twice per tick.
+    inline void handleSample(Channel& channel, boolean is_rx_high) {
+      switch (channel.state) {
+        case states::DETECT_BREAK:
+          if (!is_rx_high) {
+            if (channel.samples_count < 255) {
+              channel.samples_count++;
+            }
+            return;
+          }
+          // The end of a long enough low period is the end of a break.
+          if (channel.samples_count >= kMinBreakSamples) {
+            channel.frame_buffers[channel.head_frame_buffer].reset();
+            channel.frame_timestamps[channel.head_frame_buffer] =
+                hardware_clock::ticks32ForIsr();
+            channel.bytes_read = 0;
+            channel.state = states::WAIT_START_BIT;
+          }
+          channel.samples_count = 0;
+          return;
+
+        case states::WAIT_START_BIT:
+          if (!is_rx_high) {
+            // Sample the start bit after 2 ticks, between 1/2 and 3/4 bit from its
+            // edge, and every bit from there. The later half of the bit is safer
+            // with the slow recessive edges of LIN.
+            channel.ticks_to_sample = 2;
+            channel.bit_index = 0;
+            channel.byte_buffer = 0;
+            channel.state = states::READ_BYTE;
+            return;
+          }
+          if (++channel.samples_count >= kMaxSpaceSamples) {
+            // No more bytes in this frame.
+            completeFrame(channel);
+            channel.samples_count = 0;
+            channel.state = states::DETECT_BREAK;
+          }
+          return;
+
+        default:  // states::READ_BYTE
+          if (--channel.ticks_to_sample) {
+            return;
+          }
+          channel.ticks_to_sample = kSamplesPerBit;
+
+          // Start bit.
+          if (channel.bit_index == 0) {
+            if (is_rx_high) {
+              error_flags |= lin_processor::errors::START_BIT;
+              channel.samples_count = 0;
+              channel.state = states::DETECT_BREAK;
+              return;
+            }
+            channel.bit_index = 1;
+            return;
+          }
+
+          // Data bits, lsb first.
+          if (channel.bit_index <= 8) {
+            channel.byte_buffer >>= 1;
+            if (is_rx_high) {
+              channel.byte_buffer |= 0x80;
+            }
+            channel.bit_index++;
+            return;
+          }
+
+          // Stop bit. A low stop bit of a 0x00 byte is the begining of the break
+          // of the next frame, since we don't wait for idle time out between frames.
+          if (!is_rx_high) {
+            if (channel.byte_buffer) {
+              error_flags |= lin_processor::errors::STOP_BIT;
+              channel.samples_count = 0;
+            } else {
+              // Continue counting the break from here, including the 10 low bits
+              // of this byte.
+              if (channel.bytes_read) {
+                completeFrame(channel);
+              }
+              channel.samples_count = 10 * kSamplesPerBit;
+            }
+            channel.state = states::DETECT_BREAK;
+            return;
+          }
+
+          // A complete byte. The sync byte is verified but not stored.
+          if (channel.bytes_read == 0) {
+            if (channel.byte_buffer != 0x55) {
+              error_flags |= lin_processor::errors::SYNC_BYTE;
+              channel.samples_count = 0;
+              channel.state = states::DETECT_BREAK;
+              return;
+            }
+          } else {
+            LinFrame& frame = channel.frame_buffers[channel.head_frame_buffer];
+            frame.append_byte(channel.byte_buffer, false);
+            if (frame.num_bytes() >= LinFrame::kMaxBytes) {
+              completeFrame(channel);
+              channel.samples_count = 0;
+              channel.state = states::DETECT_BREAK;
+              return;
+            }
+          }
+          channel.bytes_read++;
+          channel.samples_count = 0;
+          channel.state = states::WAIT_START_BIT;
+          return;
+      }
+    }
+  }
+
+  // Call once in program setup.
+  extern void setup();
+
+  // Try to read next available rx frame from any of the two channels. If
+  // available, return true and set the given buffer, its channel (1 or 2) and the
+  // 32 bit hardware clock ticks at the end of its break. Otherwise, return false
+  // and leave the outputs unmodified. The channels are read in turns. The sync,
+  // id and checksum bytes of the frame are not verified.
+  extern boolean readNextFrame(LinFrame* buffer, uint8* channel, uint32* timestamp);
+
+  // Get the error flags of both channels and clear them. Uses the bits of
+  // lin_processor::errors.
+  extern uint8 getAndClearErrorFlags();
+
+  // Called from the Timer2 ISR on each sample tick. Samples both channels first
+  // so they are sampled at the same time relative to the tick.
+  inline void onIsrTick() {
+    const boolean is_rx1_high = private_::rx1_pin::isHigh();
+    const boolean is_rx2_high = private_::rx2_pin::isHigh();
+    private_::isr_pin::setHigh();
+    private_::handleSample(private_::channel1, is_rx1_high);
+    private_::handleSample(private_::channel2, is_rx2_high);
+    private_::isr_pin::setLow();
+  }
+}
+
+#endif
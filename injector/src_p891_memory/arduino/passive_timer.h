@@ -27,6 +27,12 @@ public:
     start_time_millis_ = system_clock::timeMillis();
   }
 
+  // Like restart() with a system_clock::timeMillis() value that the caller
+  // already has. Saves the clock read when restarting a batch of timers.
+  inline void restartAt(uint32 time_millis) {
+    start_time_millis_ = time_millis;
+  }
+
   void copy(const PassiveTimer &other) {
     start_time_millis_ = other.start_time_millis_;
   }
@@ -0,0 +1,139 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "settings.h"
+
+#include <avr/eeprom.h>
+
+#include "eeprom_writer.h"
+#include "sio.h"
+
+namespace settings {
+
+  namespace private_ {
+    uint16 values[kMaxKeys];
+    uint8 has_value_bits;
+
+    // The slot of the current record of each key. Valid if the key has a value.
+    static uint8 live_slots[kMaxKeys];
+
+    // The slot and sequence number of the next record.
+    static uint8 next_slot;
+    static uint32 next_sequence;
+
+    // CRC-8 with polynomial 0x07. Starts with 0xff so an all zeros record is
+    // not valid.
+    static uint8 crc8(const uint8* bytes, uint8 n) {
+      uint8 crc = 0xff;
+      for (uint8 i = 0; i < n; i++) {
+        crc ^= bytes[i];
+        for (uint8 j = 0; j < 8; j++) {
+          crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+        }
+      }
+      return crc;
+    }
+
+    static inline uint8* slotAddr(uint8 slot) {
+      return (uint8*)(kLogStartAddr + (uint16)slot * sizeof(Record));
+    }
+
+    static inline uint8 nextSlot(uint8 slot) {
+      return (slot + 1 < kNumSlots) ? (slot + 1) : 0;
+    }
+
+    // Read the record of the given slot. Returns false if it is not a valid
+    // record, e.g. an erased slot.
+    static boolean readRecord(uint8 slot, Record* record) {
+      eeprom_read_block(record, slotAddr(slot), sizeof(Record));
+      return record->key < kMaxKeys
+          && record->crc == crc8((const uint8*)record, sizeof(Record) - 1);
+    }
+
+    // Return true if the slot holds the current record of a key.
+    static boolean isLiveSlot(uint8 slot) {
+      for (uint8 key = 0; key < kMaxKeys; key++) {
+        if ((has_value_bits & H(key)) && live_slots[key] == slot) {
+          return true;
+        }
+      }
+      return false;
+    }
+  }
+
+  void setup() {
+    using namespace private_;
+
+    has_value_bits = 0;
+    next_slot = 0;
+    next_sequence = 0;
+
+    // The sequence numbers of the current records. Valid if the key has a value.
+    uint32 sequences[kMaxKeys];
+    boolean has_records = false;
+    uint8 num_records = 0;
+    for (uint8 slot = 0; slot < kNumSlots; slot++) {
+      Record record;
+      if (!readRecord(slot, &record)) {
+        continue;
+      }
+      num_records++;
+      const uint8 key = record.key;
+      if (!(has_value_bits & H(key)) || (int32)(record.sequence - sequences[key]) > 0) {
+        has_value_bits |= H(key);
+        values[key] = record.value;
+        live_slots[key] = slot;
+        sequences[key] = record.sequence;
+      }
+      // Continue the log after its last record.
+      if (!has_records || (int32)(record.sequence - next_sequence) >= 0) {
+        has_records = true;
+        next_sequence = record.sequence + 1;
+        next_slot = nextSlot(slot);
+      }
+    }
+    sio::printf(F("settings: %d records\n"), num_records);
+  }
+
+  boolean set(uint8 key, uint16 value) {
+    using namespace private_;
+
+    if (has(key) && values[key] == value) {
+      return true;
+    }
+
+    // There are more slots than keys so this always finds a slot. The previous
+    // record of the key is not overwritten before this one since the writes are
+    // in order.
+    uint8 slot = next_slot;
+    while (isLiveSlot(slot)) {
+      slot = nextSlot(slot);
+    }
+
+    Record record;
+    record.sequence = next_sequence;
+    record.key = key;
+    record.value = value;
+    record.crc = crc8((const uint8*)&record, sizeof(Record) - 1);
+    if (!eeprom_writer::write(slotAddr(slot), &record, sizeof(Record))) {
+      sio::printf(F("settings: write dropped (%d)\n"), key);
+      return false;
+    }
+
+    next_slot = nextSlot(slot);
+    next_sequence++;
+    has_value_bits |= H(key);
+    values[key] = value;
+    live_slots[key] = slot;
+    return true;
+  }
+}  // namespace settings
@@ -0,0 +1,88 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include "avr_util.h"
+
+// A small key/value store of 16 bit settings, persisted in the eeprom and
+// mirrored in RAM. Reads are from the RAM mirror and do not access the eeprom.
+//
+// The eeprom area of the store is a circular log of fixed size records, each
+// with a key, a value, a sequence number and a CRC. A write appends a record at
+// the next slot, skipping the slots that hold the current record of a key, so
+// the writes rotate over the entire area and a current record is never
+// overwritten. setup() rebuilds the RAM mirror from the record with the highest
+// sequence number of each key. Records with a bad CRC, e.g. of a write that was
+// interrupted by a power loss, are ignored.
+//
+// The records are written by eeprom_writer, without blocking. A record is
+// the current one of its key as soon as it is queued. Main thread only.
+namespace settings {
+  // Max number of keys. Keys are 0 to kMaxKeys - 1.
+  static const uint8 kMaxKeys = 8;
+
+  // The keys of the application settings. Like enum but 8 bits only.
+  namespace keys {
+    // The custom_config enabled/disabled code.
+    static const uint8 CONFIG_CODE = 0;
+    // The remembered custom_module modes, 0 or 1.
+    static const uint8 SPORT_MODE = 1;
+    static const uint8 PSE_MODE = 2;
+    static const uint8 ASS_MODE = 3;
+  }
+
+  // Private state. Do not use from other files.
+  namespace private_ {
+    // The eeprom area of the log. Above the bytes used by custom_config,
+    // custom_module and custom_injector before this store, to the end of the
+    // 1K eeprom of the ATmega328P.
+    static const uint16 kLogStartAddr = 128;
+    static const uint16 kLogEndAddr = 1024;
+
+    // A log record. The CRC is of the bytes before it.
+    struct Record {
+      uint32 sequence;
+      uint8 key;
+      uint16 value;
+      uint8 crc;
+    };
+
+    static const uint8 kNumSlots = (kLogEndAddr - kLogStartAddr) / sizeof(Record);
+
+    // The RAM mirror. A value is valid if its key bit is set in has_value_bits.
+    extern uint16 values[kMaxKeys];
+    extern uint8 has_value_bits;
+  }
+
+  // Called once from setup(). Reads the log into the RAM mirror.
+  extern void setup();
+
+  // Return true if the key has a value.
+  inline boolean has(uint8 key) {
+    return private_::has_value_bits & H(key);
+  }
+
+  // Return the value of the key, or default_value if it has no value.
+  inline uint16 get(uint8 key, uint16 default_value) {
+    return has(key) ? private_::values[key] : default_value;
+  }
+
+  // Set the value of the key and queue its record. Does not access the eeprom
+  // if the value is not changed. Returns false if the eeprom_writer queue is
+  // full, in which case the value of the key is not changed. Errors of the
+  // write itself are reported by eeprom_writer.
+  extern boolean set(uint8 key, uint16 value);
+}  // namespace settings
+
+#endif
@@ -0,0 +1,89 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "signal_events.h"
+
+#include "sio.h"
+
+namespace signal_events {
+
+  namespace private_ {
+    SignalEvent events[kMaxEvents];
+    uint8 tail_event;
+    uint8 num_events;
+    boolean has_overrun;
+
+    Handler handlers[kMaxHandlers];
+    uint8 num_handlers;
+  }
+
+  void setup() {
+    private_::tail_event = 0;
+    private_::num_events = 0;
+    private_::has_overrun = false;
+    private_::num_handlers = 0;
+  }
+
+  boolean subscribe(Handler handler) {
+    if (private_::num_handlers >= private_::kMaxHandlers) {
+      return false;
+    }
+    private_::handlers[private_::num_handlers++] = handler;
+    return true;
+  }
+
+  void post(uint8 signal_id, uint8 old_state, uint8 new_state, uint32 time_millis) {
+    using namespace private_;
+
+    // If full, drop the oldest event.
+    if (num_events >= kMaxEvents) {
+      has_overrun = true;
+      if (++tail_event >= kMaxEvents) {
+        tail_event = 0;
+      }
+      num_events--;
+    }
+
+    uint8 index = tail_event + num_events;
+    if (index >= kMaxEvents) {
+      index -= kMaxEvents;
+    }
+    SignalEvent& event = events[index];
+    event.signal_id = signal_id;
+    event.old_state = old_state;
+    event.new_state = new_state;
+    event.time_millis = time_millis;
+    num_events++;
+  }
+
+  void dispatch() {
+    using namespace private_;
+
+    if (has_overrun) {
+      sio::println(F("Signal events overrun"));
+      has_overrun = false;
+    }
+
+    // Handlers may post events, e.g. by reporting signals. These are dispatched
+    // too.
+    while (num_events) {
+      const SignalEvent event = events[tail_event];
+      if (++tail_event >= kMaxEvents) {
+        tail_event = 0;
+      }
+      num_events--;
+      for (uint8 i = 0; i < num_handlers; i++) {
+        handlers[i](event);
+      }
+    }
+  }
+}  // namespace signal_events
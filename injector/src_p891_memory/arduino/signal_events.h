@@ -0,0 +1,73 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SIGNAL_EVENTS_H
+#define SIGNAL_EVENTS_H
+
+#include "avr_util.h"
+
+// A queue of signal state changes. signal_table posts an event whenever the state
+// of a tracker changes, and the subscribed modules get the events in order from
+// dispatch(). This lets the modules react to signal edges, with the exact time of
+// the edge, instead of polling the trackers.
+//
+// Main thread only.
+namespace signal_events {
+
+  // A change of the state of a signal.
+  struct SignalEvent {
+    // The application specific id of the signal. See custom_signals.h.
+    uint8 signal_id;
+    // SignalTracker::States values.
+    uint8 old_state;
+    uint8 new_state;
+    // system_clock::timeMillis() of the change.
+    uint32 time_millis;
+  };
+
+  // A subscriber function. Gets all the events, in the order they were posted.
+  typedef void (*Handler)(const SignalEvent& event);
+
+  // Private state. Do not use from other files.
+  namespace private_ {
+    // Max number of queued events. When the queue is full, the oldest event is
+    // dropped. The events are dispatched after each frame and each loop(), so
+    // this should be at least the number of signals of the application (18, see
+    // custom_signals.cpp). A tracker scan changes all of them at ignition off.
+    static const uint8 kMaxEvents = 20;
+
+    static const uint8 kMaxHandlers = 4;
+
+    extern SignalEvent events[kMaxEvents];
+    // Index of the oldest event and number of queued events.
+    extern uint8 tail_event;
+    extern uint8 num_events;
+    extern boolean has_overrun;
+
+    extern Handler handlers[kMaxHandlers];
+    extern uint8 num_handlers;
+  }
+
+  // Called once during initialization, before the subscriptions.
+  extern void setup();
+
+  // Add a handler. Returns false if there are already kMaxHandlers handlers.
+  extern boolean subscribe(Handler handler);
+
+  // Queue an event.
+  extern void post(uint8 signal_id, uint8 old_state, uint8 new_state, uint32 time_millis);
+
+  // Called from the main loop(). Pass the queued events to the handlers.
+  extern void dispatch();
+}  // namespace signal_events
+
+#endif
@@ -0,0 +1,123 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "signal_table.h"
+
+#include "signal_events.h"
+#include "system_clock.h"
+
+namespace signal_table {
+
+  namespace private_ {
+    uint32 next_expiry_scan_millis;
+
+    // Have a tracker scan no later than the given time.
+    static inline void scheduleExpiryScan(uint32 time_millis) {
+      if ((int32)(time_millis - next_expiry_scan_millis) < 0) {
+        next_expiry_scan_millis = time_millis;
+      }
+    }
+  }
+
+  void frameArrived(const FrameDescriptor* frames, uint8 num_frames, const LinFrame& frame) {
+    const uint8 id = frame.get_byte(0);
+    for (uint8 i = 0; i < num_frames; i++) {
+      const FrameDescriptor* const frame_descriptor = &frames[i];
+      if (pgm_read_byte(&frame_descriptor->id) != id) {
+        continue;
+      }
+
+      // Id, data and checksum bytes.
+      const uint8 num_data_bytes = pgm_read_byte(&frame_descriptor->num_data_bytes);
+      if (frame.num_bytes() != num_data_bytes + 2) {
+        return;
+      }
+
+      // Update the cache and get the changed bits. All the bits of the first
+      // frame are changed.
+      FrameCache* const cache = (FrameCache*)pgm_read_word(&frame_descriptor->cache);
+      uint8 changes[kMaxDataBytes];
+      for (uint8 k = 0; k < num_data_bytes; k++) {
+        const uint8 b = frame.get_byte(k + 1);
+        changes[k] = cache->is_valid ? (b ^ cache->data[k]) : 0xff;
+        cache->data[k] = b;
+      }
+      cache->is_valid = true;
+
+      const uint32 now_millis = system_clock::timeMillis();
+      const SignalDescriptor* const signals =
+          (const SignalDescriptor*)pgm_read_word(&frame_descriptor->signals);
+      const uint8 num_signals = pgm_read_byte(&frame_descriptor->num_signals);
+      for (uint8 j = 0; j < num_signals; j++) {
+        const SignalDescriptor* const signal = &signals[j];
+        const uint8 byte_index = pgm_read_byte(&signal->byte_index);
+        const uint8 lsb_index = pgm_read_byte(&signal->lsb_index);
+        const uint8 num_bits = pgm_read_byte(&signal->num_bits);
+        const boolean is_on = extractField(cache->data, byte_index, lsb_index, num_bits)
+            == pgm_read_byte(&signal->on_value);
+        SignalTracker* const tracker = (SignalTracker*)pgm_read_word(&signal->tracker);
+        // Either report may change the state, e.g. the later reports of a multi
+        // report config or the reports that follow an expiry arrive as unchanged
+        // bits.
+        const uint8 old_state = tracker->state();
+        if (extractField(changes, byte_index, lsb_index, num_bits)) {
+          tracker->reportSignal(is_on);
+        } else {
+          tracker->reportUnchangedSignal(is_on, now_millis);
+        }
+        const uint8 new_state = tracker->state();
+        if (new_state != old_state) {
+          signal_events::post(pgm_read_byte(&signal->signal_id), old_state, new_state,
+              now_millis);
+        }
+        // May make the tracker known, with an earlier expiry than the scheduled
+        // scan.
+        if (tracker->isKnown()) {
+          private_::scheduleExpiryScan(now_millis + tracker->millisToExpiry());
+        }
+      }
+      return;
+    }
+  }
+
+  void loop(const FrameDescriptor* frames, uint8 num_frames) {
+    const uint32 now_millis = system_clock::timeMillis();
+    if ((int32)(now_millis - private_::next_expiry_scan_millis) < 0) {
+      return;
+    }
+
+    // Expire the due trackers and find the next expiry time.
+    uint32 min_millis_to_expiry = private_::kMaxExpiryScanIntervalMillis;
+    for (uint8 i = 0; i < num_frames; i++) {
+      const FrameDescriptor* const frame_descriptor = &frames[i];
+      const SignalDescriptor* const signals =
+          (const SignalDescriptor*)pgm_read_word(&frame_descriptor->signals);
+      const uint8 num_signals = pgm_read_byte(&frame_descriptor->num_signals);
+      for (uint8 j = 0; j < num_signals; j++) {
+        SignalTracker* const tracker = (SignalTracker*)pgm_read_word(&signals[j].tracker);
+        const uint8 old_state = tracker->state();
+        tracker->loop();
+        if (tracker->state() != old_state) {
+          signal_events::post(pgm_read_byte(&signals[j].signal_id), old_state,
+              tracker->state(), now_millis);
+        }
+        if (tracker->isKnown()) {
+          const uint32 millis_to_expiry = tracker->millisToExpiry();
+          if (millis_to_expiry < min_millis_to_expiry) {
+            min_millis_to_expiry = millis_to_expiry;
+          }
+        }
+      }
+    }
+    private_::next_expiry_scan_millis = now_millis + min_millis_to_expiry;
+  }
+}  // namespace signal_table
@@ -0,0 +1,108 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SIGNAL_TABLE_H
+#define SIGNAL_TABLE_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+#include "signal_tracker.h"
+
+// Table driven decoding of the signals of recieved frames. The application
+// describes its signals with const tables in program memory, one signal table per
+// frame id and a frame table that points to them. A recieved frame is looked up
+// once in the frame table and only the signals it carries are decoded.
+//
+// Each frame id keeps its last data bytes. A signal whose bits did not change
+// since the last frame only refreshes the time of its tracker, with a single
+// clock read per frame.
+//
+// The trackers are expired by deadline rather than by polling each of them on
+// every loop. The module keeps the earliest expiry time of the known trackers
+// and loop() scans them only when it is reached. Reports only move a deadline
+// later, except for a tracker that becomes known, whose deadline is merged in
+// by frameArrived(). A single signal database per program is assumed.
+//
+// Each change of a tracker state is posted to signal_events with the signal id.
+namespace signal_table {
+  // Max number of data bytes in a frame.
+  static const uint8 kMaxDataBytes = 8;
+
+  // The last data bytes of a frame id. One per FrameDescriptor, in RAM.
+  struct FrameCache {
+    // False until the first frame of this id.
+    boolean is_valid;
+    uint8 data[kMaxDataBytes];
+  };
+
+  // A signal of a frame. The signal is a field of num_bits bits (1-8) of the
+  // frame data, starting at bit lsb_index (0-7) of data byte byte_index (0 for
+  // the first data byte) and continuing to the next data byte if needed, LSB
+  // first as in the LIN spec.
+  struct SignalDescriptor {
+    // An application specific id of the signal, used in the signal events.
+    uint8 signal_id;
+    uint8 byte_index;
+    uint8 lsb_index;
+    uint8 num_bits;
+    // The tracker is reported ON when the field has this value and OFF otherwise.
+    uint8 on_value;
+    SignalTracker* tracker;
+  };
+
+  // The signals of a frame id.
+  struct FrameDescriptor {
+    // The id byte, including the parity bits.
+    uint8 id;
+    // Number of data bytes. Frames of this id with other lengths are ignored.
+    uint8 num_data_bytes;
+    // A PROGMEM table with the signals of this frame.
+    const SignalDescriptor* signals;
+    uint8 num_signals;
+    // The last data bytes of this frame id.
+    FrameCache* cache;
+  };
+
+  // Return the value of a field of the given data bytes. Caller should verify
+  // that the field is within the data.
+  inline uint8 extractField(const uint8* data, uint8 byte_index, uint8 lsb_index,
+      uint8 num_bits) {
+    uint16 bits = data[byte_index];
+    if (lsb_index + num_bits > 8) {
+      bits |= (uint16)data[byte_index + 1] << 8;
+    }
+    return (bits >> lsb_index) & ((1 << num_bits) - 1);
+  }
+
+  // Private state. Do not use from other files.
+  namespace private_ {
+    // Max time between tracker scans when no tracker is known.
+    static const uint16 kMaxExpiryScanIntervalMillis = 10000;
+
+    // The system time of the next tracker scan. Zero initialized so the first
+    // loop() scans.
+    extern uint32 next_expiry_scan_millis;
+  }
+
+  // Report the signals of the given frame to their trackers. frames is a PROGMEM
+  // table with num_frames entries. Frames with ids that are not in the table are
+  // ignored.
+  extern void frameArrived(const FrameDescriptor* frames, uint8 num_frames,
+      const LinFrame& frame);
+
+  // Call once on each iteration of the main loop(). Calls loop() of the trackers
+  // of all the signals in the given PROGMEM table when the earliest of their
+  // expiry times is due. Otherwise takes a short constant time.
+  extern void loop(const FrameDescriptor* frames, uint8 num_frames);
+}  // namespace signal_table
+
+#endif
@@ -13,11 +13,31 @@
 #ifndef SIGNAL_TRACKER_H
 #define SIGNAL_TRACKER_H
 
+#include "avr_util.h"
 #include "system_clock.h"
-#include "passive_timer.h"
+
+// Configuration of a SignalTracker. Stored in PROGMEM and typically shared by
+// many trackers.
+// * Definition: Supporting report - a call to reportSignal with a value that matches the current state.
+// * Definition: Pending report - a call to reportSignal with a value that does not match the current state. A sequence of
+// identical pending reports is required to change a state.
+struct SignalTrackerConfig {
+  // Number of equal consecutive pending reports required to change a state. 1 to
+  // SignalTracker::kMaxPendingReportsCount.
+  uint8 required_pending_reports_count;
+  // Max time in millis between pending reports to consider consecutive.
+  uint16 pending_report_ttl_millis;
+  // Max time in millis from the last supporting report before changing state to UNKNOWN.
+  uint16 supporting_report_ttl_millis;
+};
 
 // A class for trackign and conditioning boolean signal reports extracted from
 // intercepted linbus frames.
+//
+// The tracker is kept small so a program can track many signals. The config is
+// in PROGMEM, the times are 16 bit millis relative to system_clock and the state
+// is bit packed in a single byte. loop() should be called at least every 30
+// seconds to keep the 16 bit times from wrapping around.
 class SignalTracker {
 public:
 
@@ -29,154 +49,220 @@ public:
    private:
     // do not instantiate.
     States() {
-    }  
+    }
   };
 
-  // Constctor and configuration.
-  // * Definition: Supporting report - a call to reportSignal with a value that matches the current state.
-  // * Definition: Pending report - a call to reportSignal with a value that does not match the current state. A sequence of 
-  // identical pending reports is required to change a state.
-  //
-  // * required_pending_reports_count - number of equal consecutive pending reports required to change a state.
-  // * pending_report_ttl_millis - max time in millis between pending reports to consider consecutive.
-  // * supporting_report_ttl_millis - max time in millis from the last supporting report before changing state to UNKNOWN.
-  SignalTracker(uint8 required_pending_reports_count, uint16 pending_report_ttl_millis, uint16 supporting_report_ttl_millis) 
-  :  
-    required_pending_reports_count_(required_pending_reports_count),
-    pending_report_ttl_millis_(pending_report_ttl_millis),
-    supporting_report_ttl_millis_(supporting_report_ttl_millis)
+  // Max value of SignalTrackerConfig::required_pending_reports_count.
+  static const uint8 kMaxPendingReportsCount = 15;
+
+  // Max value returned by timeInStateMillis().
+  static const uint16 kMaxTimeInStateMillis = 0xffff;
+
+  // config is a PROGMEM struct.
+  SignalTracker(const SignalTrackerConfig* config)
+  :
+    config_(config)
     {
       enterStateUnknown();
     }
 
-
   // Called from the main loop() method.
   // May change the state to UNKNOWN.
   inline void loop() {
+    const uint16 now = nowMillis();
+
+    // Keep the 16 bit times from wrapping around.
+    if (!(flags_ & kTimeInStateSaturatedBit) && (uint16)(now - state_start_millis_) >= 0x8000) {
+      flags_ |= kTimeInStateSaturatedBit;
+    }
+    if (pendingReportsCount() && (uint16)(now - last_pending_report_millis_) >= pendingReportTtlMillis()) {
+      setPendingReportsCount(0);
+    }
+
     // Check for state expiration due to lack of supporting reports.
-    if (state_ == States::UNKNOWN || 
-        time_since_last_supporting_report_.timeMillis() < supporting_report_ttl_millis_) {
+    if (state() == States::UNKNOWN ||
+        (uint16)(now - last_supporting_report_millis_) < supportingReportTtlMillis()) {
       return;
     }
     // This also resets the pending reports.
     enterStateUnknown();
   }
 
+  // Returns the time in millis until loop() changes the state to UNKNOWN, or zero
+  // if it is already due. Meaningful only if the state is known.
+  inline uint32 millisToExpiry() const {
+    const uint16 elapsed_millis = nowMillis() - last_supporting_report_millis_;
+    const uint16 ttl_millis = supportingReportTtlMillis();
+    return (elapsed_millis >= ttl_millis) ? 0 : (ttl_millis - elapsed_millis);
+  }
+
   // Accept a report about the current value of the signal. apply filtering
   // logic and if conditions met, change the state to ON or OFF.
   inline void reportSignal(boolean is_on) {
+    const uint16 now = nowMillis();
+
     // Handle the case where the report matches the current state.
     if (doesReportSupportCurrentState(is_on)) {
-      time_since_last_supporting_report_.restart();
+      last_supporting_report_millis_ = now;
       return;
     }
 
-    // Here when the report contradicts the current state. That is, this is a 
+    // Here when the report contradicts the current state. That is, this is a
     // pending report.
 
     // Is this the first report in the sequence of pending reports or an addition
     // to an existing sequence with the same signal value.
-    const boolean isFirstConsecutiveReport = 
-      (consecutive_pending_reports_count_ == 0) || 
-      (consecutive_pending_reports_value_ != is_on) || 
-      (time_since_last_pending_report_.timeMillis() >= pending_report_ttl_millis_);
+    uint8 count = pendingReportsCount();
+    const boolean isFirstConsecutiveReport =
+      (count == 0) ||
+      (pendingReportsValue() != is_on) ||
+      ((uint16)(now - last_pending_report_millis_) >= pendingReportTtlMillis());
 
     // Handle the case of first consecutive pending report with this value.
     if (isFirstConsecutiveReport) {
-      consecutive_pending_reports_count_ = 1;
-      consecutive_pending_reports_value_ = is_on;
-    } 
+      count = 1;
+      if (is_on) {
+        flags_ |= kPendingValueBit;
+      } else {
+        flags_ &= ~kPendingValueBit;
+      }
+    }
     else {
-      // Handle the case of non first consecutive pending report. 
+      // Handle the case of non first consecutive pending report.
       // NOTE: should not overflow since we limit this to required_report_count.
-      consecutive_pending_reports_count_++;
+      count++;
     }
 
-    time_since_last_pending_report_.restart();   
+    last_pending_report_millis_ = now;
 
     // If insufficient number of consecutive pending reports to change state, do nothing.
-    if (consecutive_pending_reports_count_ < required_pending_reports_count_) {
+    if (count < pgm_read_byte(&config_->required_pending_reports_count)) {
+      setPendingReportsCount(count);
       return;
     }
 
     // Here when enough consecutive pending reports to change state.
 
-    // The pending report supports the new states.
-    time_since_last_supporting_report_.restart();
-    time_in_state_.restart();
-    consecutive_pending_reports_count_ = 0;
-    state_ = (is_on) ? States::ON : States::OFF;
+    // The pending report supports the new states. This also clears the pending
+    // reports count and the time in state saturation.
+    last_supporting_report_millis_ = now;
+    state_start_millis_ = now;
+    flags_ = (is_on) ? States::ON : States::OFF;
+  }
+
+  // Like reportSignal() for a signal whose value did not change since its
+  // previous report. If the state already matches the value, this is a
+  // supporting report and only its time is refreshed, using the given
+  // system_clock::timeMillis() value. Otherwise, it is the same as reportSignal().
+  inline void reportUnchangedSignal(boolean is_on, uint32 now_millis) {
+    // The pending count alone does not tell, loop() clears it when the pending
+    // reports expire.
+    if (doesReportSupportCurrentState(is_on)) {
+      last_supporting_report_millis_ = (uint16)now_millis;
+      return;
+    }
+    reportSignal(is_on);
   }
 
   // Retrieves the current state. Returns one of States values. Does not change state.
   inline uint8 state() const {
-    return state_;
+    return flags_ & kStateMask;
   }
-  
+
   // Convinience method.
   inline boolean isOn() const {
-    return state_ == States::ON;
+    return state() == States::ON;
   }
-  
+
   // Convinience method.
   inline boolean isOff() const {
-    return state_ == States::OFF;
+    return state() == States::OFF;
   }
-  
+
   // Convinience method.
   inline boolean isOnForAtLeastMillis(uint32 min_time_in_state) const {
     return isOn() &&  (timeInStateMillis() >= min_time_in_state);
   }
-  
+
   // Convinience method.
   inline boolean isKnown() const {
-    return state_ != States::UNKNOWN;
+    return state() != States::UNKNOWN;
   }
 
-  // Returns time in millis in current state. Since getState() does not change state, calling it
+  // Returns time in millis in current state, up to kMaxTimeInStateMillis. Since getState() does not change state, calling it
   // after getState() will return the time for the state returns by getState().  (that is, no race
-  // condition.). 
+  // condition.).
   inline uint32 timeInStateMillis() const {
-    return time_in_state_.timeMillis();
+    if (flags_ & kTimeInStateSaturatedBit) {
+      return kMaxTimeInStateMillis;
+    }
+    return (uint16)(nowMillis() - state_start_millis_);
   }
 
 private:
-  const uint8 required_pending_reports_count_;
-  const uint16 pending_report_ttl_millis_;
-  const uint16 supporting_report_ttl_millis_;
-
-  // The current state. One of States values.
-  uint8 state_;
-
-  // Time in the current state state_.
-  PassiveTimer time_in_state_;
+  // Bits of flags_. Bits [1:0] are the state, one of States values.
+  static const uint8 kStateMask = 0x03;
+  // Holds the value of the pending reports. Valid only if the pending reports
+  // count is not zero.
+  static const uint8 kPendingValueBit = H(2);
+  // Set by loop() when the time in state is too long for 16 bits.
+  static const uint8 kTimeInStateSaturatedBit = H(3);
+  // Bits [7:4] are the number of consecutive and equal reports that do no match
+  // the current state.
+  static const uint8 kPendingCountShift = 4;
+
+  // PROGMEM.
+  const SignalTrackerConfig* const config_;
+
+  // The state, the pending reports count and value, and the time in state
+  // saturation flag. See the bits above.
+  uint8 flags_;
+
+  // Low 16 bits of the system time millis of the start of the current state.
+  uint16 state_start_millis_;
 
   // Time of last report that supported the current state. No used when in
   // UNKNOWN state.
-  PassiveTimer time_since_last_supporting_report_;
+  uint16 last_supporting_report_millis_;
 
+  // Valid only if the pending reports count > 0; Represents the time of the
+  // last pending report.
+  uint16 last_pending_report_millis_;
 
-  // Number of consecutive and equal reports that do no match the current state.
-  uint8 consecutive_pending_reports_count_;
+  static inline uint16 nowMillis() {
+    return (uint16)system_clock::timeMillis();
+  }
 
-  // Valid only if consecutive_pending_reports_count_ > 0;  Holds the value of the
-  // pending reports.
-  boolean consecutive_pending_reports_value_;
+  inline uint16 pendingReportTtlMillis() const {
+    return pgm_read_word(&config_->pending_report_ttl_millis);
+  }
 
-  // Valid only if consecutive_pending_reports_count_ > 0; Represents the time of the
-  // last pending report.
-  PassiveTimer time_since_last_pending_report_;
+  inline uint16 supportingReportTtlMillis() const {
+    return pgm_read_word(&config_->supporting_report_ttl_millis);
+  }
+
+  inline uint8 pendingReportsCount() const {
+    return flags_ >> kPendingCountShift;
+  }
+
+  inline void setPendingReportsCount(uint8 count) {
+    flags_ = (flags_ & ~(0x0f << kPendingCountShift)) | (count << kPendingCountShift);
+  }
+
+  inline boolean pendingReportsValue() const {
+    return flags_ & kPendingValueBit;
+  }
 
   // Does the given value passed to reportSignal() matches the current state ('supporting report')
   // or may influence a change to a different state ('pending report').
   inline boolean doesReportSupportCurrentState(boolean report_is_on) {
-    switch (state_) {
-      case States::UNKNOWN:  
+    switch (state()) {
+      case States::UNKNOWN:
         // No report matches the UNKNOWN state.
         return false;
-      case States::ON: 
+      case States::ON:
         return report_is_on;
-      case States::OFF: 
+      case States::OFF:
         return !report_is_on;
     }
     // TODO: unexpected state, surface this error somehow.
@@ -184,16 +270,10 @@ private:
   }
 
   inline void enterStateUnknown() {
-    state_ = States::UNKNOWN;
-    time_in_state_.restart();
-    consecutive_pending_reports_count_ = 0;
+    // This also clears the pending reports count and the time in state saturation.
+    flags_ = States::UNKNOWN;
+    state_start_millis_ = nowMillis();
   }
 };
 
 #endif
-
-
-
-
-
-
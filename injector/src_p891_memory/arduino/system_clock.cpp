@@ -20,15 +20,14 @@ namespace system_clock {
   static const uint16 kTicksPerMilli = hardware_clock::kTicksPerMilli;
   static const uint16 kTicksPer10Millis = 10 * kTicksPerMilli;
 
-  static uint16 accounted_ticks = 0;
+  static uint32 accounted_ticks = 0;
   static uint32 time_millis = 0;
 
   void loop() {
-    const uint16 current_ticks = hardware_clock::ticksForNonIsr();
+    const uint32 current_ticks = hardware_clock::ticks32ForNonIsr();
 
-    // This 16 bit unsigned arithmetic works well also in case of a timer overflow.
-    // Assuming at least two loops per timer cycle.
-    uint16  delta_ticks = current_ticks - accounted_ticks;
+    // This 32 bit unsigned arithmetic works well also in case of a timer wrap around.
+    uint32 delta_ticks = current_ticks - accounted_ticks;
 
     // A course increment loop in case we have a large update interval. Improves
     // runtime over the single milli update loop below.
@@ -19,9 +19,8 @@
 // Uses the hardware clock to provide a 32 bit milliseconds time since program start.
 // The 32 milliseconds time has about 54 days cycle time.
 namespace system_clock {
-  // Call once per main loop(). Updates the internal millis clock based on the hardware
-  // clock. A calling interval of larger than 280ms will result in loosing time due
-  // to hardware clock overflow.
+  // Call once per main loop(). Updates the internal millis clock based on the 32 bit
+  // hardware clock ticks, so no time is lost with long calling intervals.
   extern void loop();
 
   // Return time of last update() in millis since program start. Returns zero if update() was
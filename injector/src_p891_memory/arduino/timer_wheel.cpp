@@ -0,0 +1,113 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "timer_wheel.h"
+
+#include "system_clock.h"
+
+namespace timer_wheel {
+
+  namespace private_ {
+    // The running timers of each slot, linked by their next_.
+    static Timer* slots[kNumSlots];
+
+    // The start time of the next slot to visit. A multiple of kSlotMillis.
+    static uint32 cursor_millis;
+
+    static inline uint8 slotOf(uint32 time_millis) {
+      return (time_millis >> kSlotMillisShift) & (kNumSlots - 1);
+    }
+  }
+
+  void Timer::schedule(uint32 expiry_millis) {
+    using namespace private_;
+    expiry_millis_ = expiry_millis;
+    // A time of a slot that was already visited goes to the next slot to visit.
+    const uint32 slot_millis =
+        ((int32)(expiry_millis - cursor_millis) < 0) ? cursor_millis : expiry_millis;
+    slot_ = slotOf(slot_millis);
+    next_ = slots[slot_];
+    slots[slot_] = this;
+    is_running_ = true;
+  }
+
+  void Timer::start(uint16 delay_millis) {
+    stop();
+    period_millis_ = 0;
+    schedule(system_clock::timeMillis() + delay_millis);
+  }
+
+  void Timer::startPeriodic(uint16 period_millis) {
+    stop();
+    period_millis_ = period_millis;
+    schedule(system_clock::timeMillis() + period_millis);
+  }
+
+  void Timer::stop() {
+    if (!is_running_) {
+      return;
+    }
+    Timer** link = &private_::slots[slot_];
+    while (*link != this) {
+      link = &(*link)->next_;
+    }
+    *link = next_;
+    is_running_ = false;
+  }
+
+  void setup() {
+    for (uint8 i = 0; i < private_::kNumSlots; i++) {
+      private_::slots[i] = NULL;
+    }
+    private_::cursor_millis =
+        system_clock::timeMillis() & ~(uint32)(private_::kSlotMillis - 1);
+  }
+
+  void loop() {
+    using namespace private_;
+    const uint32 now_millis = system_clock::timeMillis();
+
+    // Visit the slots that ended, at most one revolution.
+    uint8 num_visited_slots = 0;
+    while ((int32)(now_millis - (cursor_millis + kSlotMillis - 1)) >= 0) {
+      const uint8 slot = slotOf(cursor_millis);
+
+      // Fire the expired timers of the slot, one at a time since a callback may
+      // change the timers of the slot.
+      for (;;) {
+        Timer* timer = slots[slot];
+        while (timer && (int32)(now_millis - timer->expiry_millis_) < 0) {
+          timer = timer->next_;
+        }
+        if (!timer) {
+          break;
+        }
+        timer->stop();
+        if (timer->period_millis_) {
+          uint32 expiry_millis = timer->expiry_millis_ + timer->period_millis_;
+          if ((int32)(now_millis - expiry_millis) >= 0) {
+            expiry_millis = now_millis + timer->period_millis_;
+          }
+          timer->schedule(expiry_millis);
+        }
+        timer->callback_(timer->context_);
+      }
+
+      cursor_millis += kSlotMillis;
+      if (++num_visited_slots == kNumSlots) {
+        // All the slots were visited. Continue from the slot of the current time.
+        cursor_millis = now_millis & ~(uint32)(kSlotMillis - 1);
+        break;
+      }
+    }
+  }
+}  // namespace timer_wheel
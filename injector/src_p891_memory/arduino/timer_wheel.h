@@ -0,0 +1,96 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include "avr_util.h"
+
+// One shot and periodic software timers with callbacks, dispatched by a single
+// loop() call from the main loop.
+//
+// The running timers are kept in a wheel of slots of kSlotMillis each, by
+// their expiry time. loop() reads the clock once and visits only the slots
+// whose time passed since its previous call, so its cost does not depend on the
+// number of timers. Timers further than a wheel revolution stay in their slot
+// until a later revolution. Timers fire up to kSlotMillis late.
+//
+// The timers are owned by their components, typically as static variables or
+// members. Main thread only.
+namespace timer_wheel {
+  // Called with the context given to the timer when the timer expires. May
+  // start and stop timers, including its own.
+  typedef void (*Callback)(void* context);
+
+  // Private state. Do not use from other files.
+  namespace private_ {
+    // Slot duration and number of slots. Powers of 2.
+    static const uint8 kSlotMillisShift = 2;
+    static const uint8 kSlotMillis = 1 << kSlotMillisShift;
+    static const uint8 kNumSlots = 32;
+  }
+
+  class Timer {
+  public:
+    Timer(Callback callback, void* context)
+      : next_(NULL),
+        callback_(callback),
+        context_(context),
+        expiry_millis_(0),
+        period_millis_(0),
+        slot_(0),
+        is_running_(false) {
+    }
+
+    // Expire once in delay_millis. delay_millis should be at least 1 when called
+    // from a callback. Restarts the timer if it is running.
+    void start(uint16 delay_millis);
+
+    // Expire every period_millis, starting in period_millis. period_millis
+    // should be at least 1. Restarts the timer if it is running. Expirations
+    // missed by a late loop() are skipped.
+    void startPeriodic(uint16 period_millis);
+
+    // Does nothing if the timer is not running.
+    void stop();
+
+    inline boolean isRunning() const {
+      return is_running_;
+    }
+
+  private:
+    friend void loop();
+
+    // Next timer of the same slot.
+    Timer* next_;
+    const Callback callback_;
+    void* const context_;
+    // The system_clock time of the next expiration.
+    uint32 expiry_millis_;
+    // Zero for a one shot timer.
+    uint16 period_millis_;
+    // The slot of the timer. Valid if running.
+    uint8 slot_;
+    boolean is_running_;
+
+    // Add to the slot of the given expiry time. Assumes not running.
+    void schedule(uint32 expiry_millis);
+  };
+
+  // Called once from setup(), before starting timers.
+  extern void setup();
+
+  // Called from the main loop(). Calls the callbacks of the expired timers.
+  extern void loop();
+}  // namespace timer_wheel
+
+#endif